@@ -75,10 +75,16 @@ MppBufferGroupPtr gst_es_allocator_get_mpp_group(GstAllocator *allocator) {
 }
 
 MppBufferPtr get_mpp_buffer_from_gst_mem(GstMemory *gst_mem) {
+    MppBufferPtr mpp_buffer;
+
     if (gst_mem->parent) {
         return get_mpp_buffer_from_gst_mem(gst_mem->parent);
     }
-    return gst_mini_object_get_qdata(GST_MINI_OBJECT(gst_mem), get_buffer_quark());
+    mpp_buffer = gst_mini_object_get_qdata(GST_MINI_OBJECT(gst_mem), get_buffer_quark());
+    if (!mpp_buffer) {
+        mpp_buffer = gst_mini_object_get_qdata(GST_MINI_OBJECT(gst_mem), get_ext_buffer_quark());
+    }
+    return mpp_buffer;
 }
 
 static void destroy_mpp_buffer(gpointer ptr) {
@@ -137,6 +143,26 @@ GstMemory *gst_es_allocator_import_mppbuf(GstAllocator *allocator, MppBufferPtr
     return gst_mem;
 }
 
+GstMemory *gst_es_allocator_wrap_mppbuf(GstAllocator *allocator, MppBufferPtr mpp_buf) {
+    GstEsAllocator *self = GST_ES_ALLOCATOR(allocator);
+    GstMemory *gst_mem;
+    guint size;
+    gint fd;
+
+    fd = mpp_buffer_get_fd(mpp_buf);
+    if (fd < 0) {
+        GST_ERROR_OBJECT(self, "Don't get valid fd from mpp buffer.");
+        return NULL;
+    }
+
+    size = GST_ROUND_UP_N(mpp_buffer_get_size(mpp_buf), 4096);
+    gst_mem = gst_fd_allocator_alloc(allocator, dup(fd), size, GST_FD_MEMORY_FLAG_KEEP_MAPPED);
+
+    // no reference is taken here, the buffer pool holds the mpp buffer on the memory
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(gst_mem), get_buffer_quark(), mpp_buf, NULL);
+    return gst_mem;
+}
+
 GstMemory *gst_es_allocator_import_gst_memory(GstAllocator *allocator, GstMemory *gst_mem) {
     MppBufferPtr mpp_buffer;
     gsize offset;
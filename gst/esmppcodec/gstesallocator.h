@@ -27,6 +27,7 @@
 gint gst_es_allocator_get_index(GstAllocator *allocator);
 MppBufferGroupPtr gst_es_allocator_get_mpp_group(GstAllocator *allocator);
 GstMemory *gst_es_allocator_import_mppbuf(GstAllocator *allocator, MppBufferPtr mpp_buf);
+GstMemory *gst_es_allocator_wrap_mppbuf(GstAllocator *allocator, MppBufferPtr mpp_buf);
 GstMemory *gst_es_allocator_import_gst_memory(GstAllocator *allocator, GstMemory *gst_mem);
 GstAllocator *gst_es_allocator_new(gboolean cache);
 
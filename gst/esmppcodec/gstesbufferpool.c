@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Tangdaoyong <tangdaoyong@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/stat.h>
+#include <gst/allocators/gstdmabuf.h>
+#include "gstesbufferpool.h"
+#include "gstesallocator.h"
+#include "mpp_buffer.h"
+
+#define GST_TYPE_ES_BUFFER_POOL (gst_es_buffer_pool_get_type())
+G_DECLARE_FINAL_TYPE(GstEsBufferPool, gst_es_buffer_pool, GST, ES_BUFFER_POOL, GstVideoBufferPool);
+
+#define GST_ES_BUFFER_POOL(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_ES_BUFFER_POOL, GstEsBufferPool))
+
+#define GST_CAT_DEFAULT esbufferpool_debug
+GST_DEBUG_CATEGORY_STATIC(GST_CAT_DEFAULT);
+
+/* acquire the wrapper of a given mpp buffer instead of allocating a new buffer */
+#define GST_ES_BUFFER_POOL_ACQUIRE_FLAG_MPP (GST_BUFFER_POOL_ACQUIRE_FLAG_LAST << 0)
+
+typedef struct {
+    GstBufferPoolAcquireParams parent;
+    MppBufferPtr mpp_buf;
+    const GstVideoInfo *info;
+} GstEsBufferPoolAcquireParams;
+
+struct _GstEsBufferPool {
+    GstVideoBufferPool parent;
+    GstAllocator *allocator;
+    GHashTable *idle_buffers; /* MppBufferPtr -> released GstBuffer wrapper */
+    GHashTable *ext_buffers;  /* MppBufferPtr -> imported downstream GstBuffer */
+};
+
+#define gst_es_buffer_pool_parent_class parent_class
+G_DEFINE_TYPE(GstEsBufferPool, gst_es_buffer_pool, GST_TYPE_VIDEO_BUFFER_POOL);
+
+static GQuark get_mpp_buffer_quark(void) {
+    static GQuark quark = 0;
+    if (quark == 0) {
+        quark = g_quark_from_string("es-pool-mpp-buf");
+    }
+    return quark;
+}
+
+static GQuark get_mpp_ref_quark(void) {
+    static GQuark quark = 0;
+    if (quark == 0) {
+        quark = g_quark_from_string("es-pool-mpp-ref");
+    }
+    return quark;
+}
+
+static void destroy_mpp_buffer(gpointer ptr) {
+    MppBufferPtr mpp_buf = ptr;
+    mpp_buffer_put(mpp_buf);
+}
+
+/* The mpp reference lives on the memory, so that copies of the wrapper made
+ * downstream keep mpp from decoding into the buffer until they are all gone.
+ */
+static void hold_mpp_buffer(GstBuffer *buffer, MppBufferPtr mpp_buf) {
+    mpp_buffer_inc_ref(mpp_buf);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(gst_buffer_peek_memory(buffer, 0)),
+                              get_mpp_ref_quark(),
+                              mpp_buf,
+                              destroy_mpp_buffer);
+}
+
+static gboolean memory_is_shared(GstBuffer *buffer) {
+    GstMemory *gst_mem = gst_buffer_peek_memory(buffer, 0);
+
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_TAG_MEMORY) || gst_buffer_n_memory(buffer) != 1) {
+        return TRUE;
+    }
+    return !gst_buffer_is_all_memory_writable(buffer) || GST_MINI_OBJECT_REFCOUNT_VALUE(gst_mem) > 1;
+}
+
+static gboolean same_dmabuf(gint fd, gint other_fd) {
+    struct stat st, other_st;
+
+    if (fd < 0 || other_fd < 0 || fstat(fd, &st) || fstat(other_fd, &other_st)) {
+        return FALSE;
+    }
+    return st.st_dev == other_st.st_dev && st.st_ino == other_st.st_ino;
+}
+
+static void set_video_meta(GstBuffer *buffer, const GstVideoInfo *info) {
+    GstVideoMeta *meta;
+    guint i;
+
+    meta = gst_buffer_get_video_meta(buffer);
+    if (!meta) {
+        meta = gst_buffer_add_video_meta_full(buffer,
+                                              GST_VIDEO_FRAME_FLAG_NONE,
+                                              GST_VIDEO_INFO_FORMAT(info),
+                                              GST_VIDEO_INFO_WIDTH(info),
+                                              GST_VIDEO_INFO_HEIGHT(info),
+                                              GST_VIDEO_INFO_N_PLANES(info),
+                                              (gsize *)info->offset,
+                                              (gint *)info->stride);
+        // keep the meta when the buffer goes back to the pool
+        GST_META_FLAG_SET(meta, GST_META_FLAG_POOLED);
+        return;
+    }
+
+    meta->format = GST_VIDEO_INFO_FORMAT(info);
+    meta->width = GST_VIDEO_INFO_WIDTH(info);
+    meta->height = GST_VIDEO_INFO_HEIGHT(info);
+    meta->n_planes = GST_VIDEO_INFO_N_PLANES(info);
+    for (i = 0; i < meta->n_planes; i++) {
+        meta->offset[i] = info->offset[i];
+        meta->stride[i] = info->stride[i];
+    }
+}
+
+static GstBuffer *wrap_mpp_buffer(GstEsBufferPool *self, MppBufferPtr mpp_buf, GstBuffer *ext_buf) {
+    GstBuffer *buffer;
+    GstMemory *gst_mem;
+
+    // mpp decoded into a downstream buffer, hand out a share of its memory
+    if (ext_buf) {
+        gst_mem = gst_memory_share(gst_buffer_peek_memory(ext_buf, 0), 0, -1);
+    } else {
+        gst_mem = gst_es_allocator_wrap_mppbuf(self->allocator, mpp_buf);
+    }
+    if (!gst_mem) {
+        return NULL;
+    }
+
+    buffer = gst_buffer_new();
+    gst_buffer_append_memory(buffer, gst_mem);
+    GST_BUFFER_FLAG_UNSET(buffer, GST_BUFFER_FLAG_TAG_MEMORY);
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(buffer), get_mpp_buffer_quark(), mpp_buf, NULL);
+
+    GST_DEBUG_OBJECT(self, "wrapped mpp buffer %p (fd %d)", mpp_buf, mpp_buffer_get_fd(mpp_buf));
+    return buffer;
+}
+
+static gboolean wrapper_is_valid(GstEsBufferPool *self, GstBuffer *buffer, MppBufferPtr mpp_buf, GstBuffer *ext_buf) {
+    GstMemory *gst_mem = gst_buffer_peek_memory(buffer, 0);
+
+    if (ext_buf) {
+        return gst_mem->parent == gst_buffer_peek_memory(ext_buf, 0);
+    }
+    if (gst_mem->allocator != self->allocator) {
+        return FALSE;
+    }
+    // a freed mpp buffer may come back at the same address with another size or dmabuf
+    return gst_mem->maxsize == GST_ROUND_UP_N(mpp_buffer_get_size(mpp_buf), 4096)
+           && same_dmabuf(gst_dmabuf_memory_get_fd(gst_mem), mpp_buffer_get_fd(mpp_buf));
+}
+
+GstFlowReturn gst_es_buffer_pool_acquire_mpp_buffer(GstBufferPool *pool,
+                                                    MppBufferPtr mpp_buf,
+                                                    const GstVideoInfo *info,
+                                                    GstBuffer **buffer) {
+    GstEsBufferPoolAcquireParams params;
+
+    memset(&params, 0, sizeof(params));
+    params.parent.flags = GST_ES_BUFFER_POOL_ACQUIRE_FLAG_MPP;
+    params.mpp_buf = mpp_buf;
+    params.info = info;
+    return gst_buffer_pool_acquire_buffer(pool, buffer, (GstBufferPoolAcquireParams *)&params);
+}
+
+static GstFlowReturn gst_es_buffer_pool_acquire_buffer(GstBufferPool *pool,
+                                                       GstBuffer **buffer,
+                                                       GstBufferPoolAcquireParams *params) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(pool);
+    GstEsBufferPoolAcquireParams *es_params;
+    GstBuffer *gst_buffer, *ext_buf;
+
+    if (!params || !(params->flags & GST_ES_BUFFER_POOL_ACQUIRE_FLAG_MPP)) {
+        return GST_BUFFER_POOL_CLASS(parent_class)->acquire_buffer(pool, buffer, params);
+    }
+    es_params = (GstEsBufferPoolAcquireParams *)params;
+
+    GST_OBJECT_LOCK(self);
+    gst_buffer = g_hash_table_lookup(self->idle_buffers, es_params->mpp_buf);
+    if (gst_buffer) {
+        g_hash_table_steal(self->idle_buffers, es_params->mpp_buf);
+    }
+    ext_buf = g_hash_table_lookup(self->ext_buffers, es_params->mpp_buf);
+    if (ext_buf) {
+        gst_buffer_ref(ext_buf);
+    }
+    GST_OBJECT_UNLOCK(self);
+
+    if (gst_buffer && !wrapper_is_valid(self, gst_buffer, es_params->mpp_buf, ext_buf)) {
+        gst_buffer_unref(gst_buffer);
+        gst_buffer = NULL;
+    }
+    if (!gst_buffer) {
+        gst_buffer = wrap_mpp_buffer(self, es_params->mpp_buf, ext_buf);
+    }
+    if (ext_buf) {
+        gst_buffer_unref(ext_buf);
+    }
+    if (!gst_buffer) {
+        return GST_FLOW_ERROR;
+    }
+    set_video_meta(gst_buffer, es_params->info);
+
+    hold_mpp_buffer(gst_buffer, es_params->mpp_buf);
+    *buffer = gst_buffer;
+    return GST_FLOW_OK;
+}
+
+static void gst_es_buffer_pool_release_buffer(GstBufferPool *pool, GstBuffer *buffer) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(pool);
+    MppBufferPtr mpp_buf;
+
+    mpp_buf = gst_mini_object_get_qdata(GST_MINI_OBJECT(buffer), get_mpp_buffer_quark());
+    if (!mpp_buf) {
+        GST_BUFFER_POOL_CLASS(parent_class)->release_buffer(pool, buffer);
+        return;
+    }
+
+    // copies still show the memory, it goes back to mpp when the last one is freed
+    if (memory_is_shared(buffer)) {
+        GST_DEBUG_OBJECT(self, "memory of mpp buffer %p still in use, dropping wrapper", mpp_buf);
+        gst_buffer_unref(buffer);
+        return;
+    }
+
+    gst_mini_object_steal_qdata(GST_MINI_OBJECT(gst_buffer_peek_memory(buffer, 0)), get_mpp_ref_quark());
+    GST_OBJECT_LOCK(self);
+    g_hash_table_insert(self->idle_buffers, mpp_buf, buffer);
+    GST_OBJECT_UNLOCK(self);
+
+    // let mpp reuse the buffer, its wrapper is picked up again on the next output
+    mpp_buffer_put(mpp_buf);
+}
+
+/* Import a downstream dmabuf buffer into an external mpp group so that mpp
+ * decodes into it. The pool keeps the buffer until the imports are cleared.
+ */
+gboolean gst_es_buffer_pool_import_external(GstBufferPool *pool,
+                                            MppBufferGroupPtr group,
+                                            GstBuffer *buffer,
+                                            gsize min_size) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(pool);
+    MppBufferPtr mpp_buf = NULL;
+    MppBufferInfo mpp_buf_info;
+    GstMemory *gst_mem;
+    gsize size, offset;
+
+    if (gst_buffer_n_memory(buffer) != 1) {
+        goto error;
+    }
+    gst_mem = gst_buffer_peek_memory(buffer, 0);
+    size = gst_memory_get_sizes(gst_mem, &offset, NULL);
+    if (!gst_is_dmabuf_memory(gst_mem) || offset || size < min_size) {
+        goto error;
+    }
+
+    memset(&mpp_buf_info, 0, sizeof(MppBufferInfo));
+    mpp_buf_info.type = MPP_BUFFER_TYPE_DMA_HEAP;
+    mpp_buf_info.fd = gst_dmabuf_memory_get_fd(gst_mem);
+    mpp_buf_info.size = size;
+    mpp_buffer_import_with_tag(group, &mpp_buf_info, &mpp_buf, NULL, __func__);
+    if (!mpp_buf) {
+        goto error;
+    }
+
+    GST_OBJECT_LOCK(self);
+    g_hash_table_insert(self->ext_buffers, mpp_buf, buffer);
+    GST_OBJECT_UNLOCK(self);
+
+    GST_DEBUG_OBJECT(self, "imported %" GST_PTR_FORMAT " as mpp buffer %p", buffer, mpp_buf);
+    // leave it unused in the group, mpp picks it as a decoding target
+    mpp_buffer_put(mpp_buf);
+    return TRUE;
+
+error:
+    GST_WARNING_OBJECT(self, "cannot decode into %" GST_PTR_FORMAT, buffer);
+    gst_buffer_unref(buffer);
+    return FALSE;
+}
+
+void gst_es_buffer_pool_clear_external(GstBufferPool *pool) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(pool);
+
+    GST_OBJECT_LOCK(self);
+    g_hash_table_remove_all(self->ext_buffers);
+    GST_OBJECT_UNLOCK(self);
+}
+
+static gboolean gst_es_buffer_pool_set_config(GstBufferPool *pool, GstStructure *config) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(pool);
+    GstAllocator *allocator = NULL;
+
+    if (!gst_buffer_pool_config_get_allocator(config, &allocator, NULL) || !allocator ||
+        g_strcmp0(allocator->mem_type, "esallocator")) {
+        GST_ERROR_OBJECT(self, "pool needs an es allocator");
+        return FALSE;
+    }
+    gst_object_replace((GstObject **)&self->allocator, GST_OBJECT(allocator));
+
+    return GST_BUFFER_POOL_CLASS(parent_class)->set_config(pool, config);
+}
+
+static gboolean gst_es_buffer_pool_stop(GstBufferPool *pool) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(pool);
+
+    GST_OBJECT_LOCK(self);
+    g_hash_table_remove_all(self->idle_buffers);
+    g_hash_table_remove_all(self->ext_buffers);
+    GST_OBJECT_UNLOCK(self);
+
+    return GST_BUFFER_POOL_CLASS(parent_class)->stop(pool);
+}
+
+GstBufferPool *gst_es_buffer_pool_new(void) {
+    GstEsBufferPool *pool;
+
+    pool = g_object_new(GST_TYPE_ES_BUFFER_POOL, NULL);
+    gst_object_ref_sink(pool);
+    return GST_BUFFER_POOL_CAST(pool);
+}
+
+static void gst_es_buffer_pool_finalize(GObject *obj) {
+    GstEsBufferPool *self = GST_ES_BUFFER_POOL(obj);
+    g_hash_table_destroy(self->idle_buffers);
+    g_hash_table_destroy(self->ext_buffers);
+    if (self->allocator) gst_object_unref(self->allocator);
+    G_OBJECT_CLASS(parent_class)->finalize(obj);
+}
+
+static void gst_es_buffer_pool_class_init(GstEsBufferPoolClass *klass) {
+    GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS(klass);
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "esbufferpool", 0, "ESWIN buffer pool");
+
+    pool_class->acquire_buffer = GST_DEBUG_FUNCPTR(gst_es_buffer_pool_acquire_buffer);
+    pool_class->release_buffer = GST_DEBUG_FUNCPTR(gst_es_buffer_pool_release_buffer);
+    pool_class->set_config = GST_DEBUG_FUNCPTR(gst_es_buffer_pool_set_config);
+    pool_class->stop = GST_DEBUG_FUNCPTR(gst_es_buffer_pool_stop);
+    gobject_class->finalize = GST_DEBUG_FUNCPTR(gst_es_buffer_pool_finalize);
+}
+
+static void gst_es_buffer_pool_init(GstEsBufferPool *pool) {
+    pool->idle_buffers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)gst_buffer_unref);
+    pool->ext_buffers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)gst_buffer_unref);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Tangdaoyong <tangdaoyong@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_ES_BUFFER_POOL_H__
+#define __GST_ES_BUFFER_POOL_H__
+
+#include <gst/video/video.h>
+#include "mpp_type.h"
+
+GstBufferPool *gst_es_buffer_pool_new(void);
+GstFlowReturn gst_es_buffer_pool_acquire_mpp_buffer(GstBufferPool *pool,
+                                                    MppBufferPtr mpp_buf,
+                                                    const GstVideoInfo *info,
+                                                    GstBuffer **buffer);
+gboolean gst_es_buffer_pool_import_external(GstBufferPool *pool,
+                                            MppBufferGroupPtr group,
+                                            GstBuffer *buffer,
+                                            gsize min_size);
+void gst_es_buffer_pool_clear_external(GstBufferPool *pool);
+
+#endif
@@ -29,6 +29,7 @@
 #include "gstesvideodec.h"
 #include "gstesjpegenc.h"
 #include "gstesjpegdec.h"
+#include "gstesgopdec.h"
 
 GST_DEBUG_CATEGORY_STATIC(esmpp_debug);
 #define GST_CAT_DEFAULT esmpp_debug
@@ -124,7 +125,7 @@ const char* gst_es_mpp_format_to_string(MppFrameFormat pix_fmt) {
     }
 }
 
-gboolean gst_es_video_info_align(GstVideoInfo* info, gint hstride, gint vstride) {
+gboolean gst_es_video_info_align(GstVideoInfo* info, gint hstride, gint vstride, guint stride_align) {
     GstVideoAlignment align;
     guint stride = 0;
     guint i = 0;
@@ -132,7 +133,7 @@ gboolean gst_es_video_info_align(GstVideoInfo* info, gint hstride, gint vstride)
     gint v_stride = 0;
 
     if (0 == hstride) {
-        h_stride = GST_ES_ALIGN(GST_ES_VIDEO_INFO_HSTRIDE(info));
+        h_stride = GST_ES_ALIGN_N(GST_ES_VIDEO_INFO_HSTRIDE(info), stride_align);
     } else {
         h_stride = hstride;
     }
@@ -164,6 +165,68 @@ gboolean gst_es_video_info_align(GstVideoInfo* info, gint hstride, gint vstride)
     return TRUE;
 }
 
+/* Describe the padding and stride alignment of an aligned info, stride_align
+ * is the byte alignment of the first plane, 0 when there is no requirement.
+ */
+void gst_es_video_alignment_from_info(GstVideoAlignment* align, GstVideoInfo* info, guint stride_align) {
+    guint stride0 = GST_ES_VIDEO_INFO_HSTRIDE(info);
+    guint plane_align;
+    guint i;
+
+    gst_video_alignment_reset(align);
+    align->padding_right = gst_es_get_pixel_stride(info) - GST_VIDEO_INFO_WIDTH(info);
+    align->padding_bottom = GST_ES_VIDEO_INFO_VSTRIDE(info) - GST_VIDEO_INFO_HEIGHT(info);
+    if (stride_align <= 1 || !stride0) {
+        return;
+    }
+    for (i = 0; i < GST_VIDEO_INFO_N_PLANES(info); i++) {
+        // subsampled planes need a proportionally smaller alignment
+        plane_align = stride_align * GST_VIDEO_INFO_PLANE_STRIDE(info, i) / stride0;
+        align->stride_align[i] = plane_align > 1 ? plane_align - 1 : 0;
+    }
+}
+
+/* Collect the first-plane stride alignment (in bytes) a peer announced in an
+ * allocation query, either through the video meta params or the config of a
+ * proposed pool. Returns 0 when nothing was announced.
+ */
+guint gst_es_query_get_stride_align(GstQuery* query) {
+    const GstStructure* params = NULL;
+    GstVideoAlignment align;
+    GstStructure* config;
+    GstBufferPool* pool;
+    guint stride_align = 0;
+    guint mask = 0;
+    guint idx, i;
+
+    if (gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, &idx)) {
+        gst_query_parse_nth_allocation_meta(query, idx, &params);
+        if (params && gst_structure_get_uint(params, "stride-align0", &mask)) {
+            stride_align = mask + 1;
+        }
+    }
+
+    for (i = 0; i < gst_query_get_n_allocation_pools(query); i++) {
+        gst_query_parse_nth_allocation_pool(query, i, &pool, NULL, NULL, NULL);
+        if (!pool) {
+            continue;
+        }
+        config = gst_buffer_pool_get_config(pool);
+        if (gst_buffer_pool_config_has_option(config, GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT) &&
+            gst_buffer_pool_config_get_video_alignment(config, &align)) {
+            stride_align = MAX(stride_align, align.stride_align[0] + 1);
+        }
+        gst_structure_free(config);
+        gst_object_unref(pool);
+    }
+
+    // only power of two alignments can be programmed into mpp
+    if (stride_align & (stride_align - 1)) {
+        stride_align = 0;
+    }
+    return stride_align > 1 ? stride_align : 0;
+}
+
 static gboolean plugin_init(GstPlugin* plugin) {
     GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "esplugin", 0, "ESWIN video plugin");
     gst_es_h264_enc_register(plugin, GST_RANK_PRIMARY + 1);
@@ -171,6 +234,8 @@ static gboolean plugin_init(GstPlugin* plugin) {
     gst_es_video_dec_register(plugin, GST_RANK_PRIMARY + 1);
     gst_es_jpeg_enc_register(plugin, GST_RANK_PRIMARY + 1);
     gst_es_jpeg_dec_register(plugin, GST_RANK_PRIMARY + 1);
+    // offline use only, never autoplugged
+    gst_es_gop_dec_register(plugin, GST_RANK_NONE);
     return TRUE;
 }
 
@@ -32,11 +32,15 @@ G_BEGIN_DECLS;
     (GST_VIDEO_INFO_N_PLANES(i) == 1 ? GST_VIDEO_INFO_HEIGHT(i) \
                                      : (gint)(GST_VIDEO_INFO_PLANE_OFFSET(i, 1) / GST_ES_VIDEO_INFO_HSTRIDE(i)))
 
-#define GST_ES_ALIGN(v) GST_ROUND_UP_N(v, 16)  // Hardcode, set to 16 as default
+#define GST_ES_DEFAULT_ALIGN 16  // used when neither side asks for a stride alignment
+#define GST_ES_ALIGN_N(v, a) GST_ROUND_UP_N(v, (a) ? (a) : GST_ES_DEFAULT_ALIGN)
+#define GST_ES_ALIGN(v) GST_ES_ALIGN_N(v, GST_ES_DEFAULT_ALIGN)
 
 GstVideoFormat gst_es_mpp_format_to_gst_format(MppFrameFormat mpp_format);
 MppFrameFormat gst_es_gst_format_to_mpp_format(GstVideoFormat gst_format);
-gboolean gst_es_video_info_align(GstVideoInfo* info, gint hstride, gint vstride);
+gboolean gst_es_video_info_align(GstVideoInfo* info, gint hstride, gint vstride, guint stride_align);
+void gst_es_video_alignment_from_info(GstVideoAlignment* align, GstVideoInfo* info, guint stride_align);
+guint gst_es_query_get_stride_align(GstQuery* query);
 guint gst_es_get_pixel_stride(GstVideoInfo* info);
 const char* gst_es_mpp_format_to_string(MppFrameFormat pix_fmt);
 
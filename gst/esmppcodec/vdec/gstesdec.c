@@ -23,7 +23,9 @@
 #include "config.h"
 #endif
 
+#include <gst/allocators/gstdmabuf.h>
 #include "gstesallocator.h"
+#include "gstesbufferpool.h"
 #include "gstesdec.h"
 
 #define GST_CAT_DEFAULT es_dec_debug
@@ -36,9 +38,14 @@ G_DEFINE_ABSTRACT_TYPE(GstEsDec, gst_es_dec, GST_TYPE_VIDEO_DECODER);
 
 #define OUT_TIMEOUT_MS (200)
 #define IN_TIMEOUT_MS (2000)
+#define WATCHDOG_MS (5000)
+#define IN_SLOTS (8)
+#define WATCHDOG_PACKETS (32) /* more than any reorder delay, silence after that is a stall */
 
 #define DISPLAY_BUFFER_CNT (4)
 
+#define PTS_MATCH_TOLERANCE (3 * GST_MSECOND)
+
 #define MPP_TO_GST_PTS(pts) ((pts) * GST_MSECOND)
 
 #define TASK_IS_STARTED(decoder) (gst_pad_get_task_state((decoder)->srcpad) == GST_TASK_STARTED)
@@ -57,6 +64,36 @@ G_DEFINE_ABSTRACT_TYPE(GstEsDec, gst_es_dec, GST_TYPE_VIDEO_DECODER);
         g_mutex_unlock(GST_ES_DEC_MUTEX(decoder)); \
     } while (0)
 
+#define GST_ES_DEC_BROADCAST(decoder)                     \
+    do {                                                  \
+        g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(decoder));    \
+        g_cond_broadcast(GST_ES_DEC_EVENT_COND(decoder)); \
+        g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(decoder));  \
+    } while (0)
+
+#define GST_ES_DEC_WAIT(decoder, condition)                                               \
+    do {                                                                                  \
+        g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(decoder));                                    \
+        while (!(condition)) {                                                            \
+            g_cond_wait(GST_ES_DEC_EVENT_COND(decoder), GST_ES_DEC_EVENT_MUTEX(decoder)); \
+        }                                                                                 \
+        g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(decoder));                                  \
+    } while (0)
+
+/* entry of the output queue, see fetch_loop */
+typedef struct {
+    MppFramePtr frame; /* NULL once the picture is dropped */
+    ES_S64 pts;
+    guint ctx;
+    gboolean picture; /* holds a decoded picture */
+} GstEsDecOutput;
+
+/* entry of the pending frame index, sorted by pts */
+typedef struct {
+    GstClockTime pts;
+    guint32 frame_number;
+} GstEsDecPendingFrame;
+
 typedef enum {
     PROP_0,
     PROP_OUT_WIDTH,
@@ -69,6 +106,13 @@ typedef enum {
     PROP_EXTRA_HW_FRM,
     PROP_BUF_CACHE,
     PROP_TEST_MEMSET_OUTPUT,
+    PROP_IN_TIMEOUT,
+    PROP_MEM_OPTIMIZE,
+    PROP_LOW_LATENCY,
+    PROP_WATCHDOG,
+    PROP_IN_SLOTS,
+    PROP_OUTPUT_QUEUE_SIZE,
+    PROP_DROP_POLICY,
 } ES_DEC_PROP_E;
 
 static void gst_es_dec_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
@@ -151,6 +195,60 @@ static void gst_es_dec_set_property(GObject *object, guint prop_id, const GValue
                 GST_WARNING_OBJECT(decoder, "invalid value of memset output");
             break;
         }
+        case PROP_IN_TIMEOUT: {
+            if (val <= 0)
+                GST_WARNING_OBJECT(decoder, "unable to change input timeout");
+            else
+                self->in_timeout = val;
+            break;
+        }
+        case PROP_MEM_OPTIMIZE: {
+            if (val == 0 || val == 1)
+                self->mem_optimize = (gboolean)val;
+            else
+                GST_WARNING_OBJECT(decoder, "invalid value of memory optimize");
+            break;
+        }
+        case PROP_LOW_LATENCY: {
+            if (val == 0 || val == 1)
+                self->low_latency = (gboolean)val;
+            else
+                GST_WARNING_OBJECT(decoder, "invalid value of low latency");
+            break;
+        }
+        case PROP_WATCHDOG: {
+            if (val < 0)
+                GST_WARNING_OBJECT(decoder, "invalid value of watchdog");
+            else
+                self->watchdog = val;
+            break;
+        }
+        case PROP_IN_SLOTS: {
+            if (self->in_grp)
+                GST_WARNING_OBJECT(decoder, "unable to change input slots");
+            else if (val < 0)
+                GST_WARNING_OBJECT(decoder, "invalid value of input slots");
+            else
+                self->in_slots = val;
+            break;
+        }
+        case PROP_OUTPUT_QUEUE_SIZE: {
+            // the buffer group is sized for the queue on the next info change
+            if (self->input_state)
+                GST_WARNING_OBJECT(decoder, "unable to change output queue size");
+            else if (val < 0)
+                GST_WARNING_OBJECT(decoder, "invalid value of output queue size");
+            else
+                self->output_queue_size = val;
+            break;
+        }
+        case PROP_DROP_POLICY: {
+            if (val >= GST_ES_DEC_DROP_NONE && val <= GST_ES_DEC_DROP_NEWEST)
+                self->drop_policy = val;
+            else
+                GST_WARNING_OBJECT(decoder, "invalid value of drop policy");
+            break;
+        }
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
             break;
@@ -192,52 +290,152 @@ static void gst_es_dec_get_property(GObject *object, guint prop_id, GValue *valu
         case PROP_TEST_MEMSET_OUTPUT:
             g_value_set_int(value, self->memset_output);
             break;
+        case PROP_IN_TIMEOUT:
+            g_value_set_int(value, self->in_timeout);
+            break;
+        case PROP_MEM_OPTIMIZE:
+            g_value_set_int(value, self->mem_optimize);
+            break;
+        case PROP_LOW_LATENCY:
+            g_value_set_int(value, self->low_latency);
+            break;
+        case PROP_WATCHDOG:
+            g_value_set_int(value, self->watchdog);
+            break;
+        case PROP_IN_SLOTS:
+            g_value_set_int(value, self->in_slots);
+            break;
+        case PROP_OUTPUT_QUEUE_SIZE:
+            g_value_set_int(value, self->output_queue_size);
+            break;
+        case PROP_DROP_POLICY:
+            g_value_set_int(value, self->drop_policy);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
             return;
     }
 }
 
-static void shut_down(GstVideoDecoder *decoder, gboolean drain) {
+static void notify_input(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(decoder));
+    self->in_seq++;
+    g_cond_broadcast(GST_ES_DEC_EVENT_COND(decoder));
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(decoder));
+}
+
+/* Wait for the output loop to stop on eos. The watchdog covers the drain as
+ * well, FALSE if nothing came out of mpp for that long.
+ */
+static gboolean wait_task_stopped(GstEsDec *self, GstTask *task) {
+    gint64 start = g_get_monotonic_time();
+    gint64 end_time;
+    gboolean stopped = TRUE;
+
+    GST_OBJECT_LOCK(task);
+    while (GST_TASK_STATE(task) == GST_TASK_STARTED) {
+        if (!self->watchdog) {
+            GST_TASK_WAIT(task);
+            continue;
+        }
+        end_time = MAX(self->last_output, start) + (gint64)self->watchdog * G_TIME_SPAN_MILLISECOND;
+        if (g_get_monotonic_time() >= end_time) {
+            stopped = FALSE;
+            break;
+        }
+        g_cond_wait_until(GST_TASK_GET_COND(task), GST_OBJECT_GET_LOCK(task), end_time);
+    }
+    GST_OBJECT_UNLOCK(task);
+    return stopped;
+}
+
+/* TRUE if a drain did not get through, the contexts are to be recovered like a stall */
+static gboolean shut_down(GstVideoDecoder *decoder, gboolean drain) {
     GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstTask *task;
+    gboolean stalled = FALSE;
 
     if (!TASK_IS_STARTED(decoder)) {
         GST_DEBUG_OBJECT(decoder, "Not start, no need to shut down");
-        return;
+        return FALSE;
     }
 
     GST_VIDEO_DECODER_STREAM_UNLOCK(decoder);
+    // wake up the output loop, it may be waiting for input
+    GST_ES_DEC_BROADCAST(decoder);
     if (klass->shutdown && klass->shutdown(decoder, drain)) {
-        GstTask *task = decoder->srcpad->task;
-        if (task) {
-            GST_OBJECT_LOCK(task);
-            while (GST_TASK_STATE(task) == GST_TASK_STARTED) {
-                GST_TASK_WAIT(task);
-            }
-            GST_OBJECT_UNLOCK(task);
+        task = decoder->srcpad->task;
+        if (task && !wait_task_stopped(self, task)) {
+            GST_WARNING_OBJECT(self, "no output for %d ms while draining, hardware stalled", self->watchdog);
+            stalled = TRUE;
         }
+    } else if (drain) {
+        GST_WARNING_OBJECT(self, "failed to send eos, hardware stalled");
+        stalled = TRUE;
+    }
+    if (stalled) {
+        // stop the output like a flush, the pictures still in mpp are dropped with the reset
+        self->is_draining = FALSE;
+        GST_ES_DEC_BROADCAST(decoder);
     }
 
     gst_pad_stop_task(decoder->srcpad);
     GST_VIDEO_DECODER_STREAM_LOCK(decoder);
+    return stalled;
+}
+
+/* the src pad task is stopped, the frames of queued pictures go with the reset */
+static void stop_fetch_thread(GstEsDec *self) {
+    GstEsDecOutput *output;
+
+    if (!self->fetch_thread) {
+        return;
+    }
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(self));
+    self->fetching = FALSE;
+    g_cond_broadcast(GST_ES_DEC_EVENT_COND(self));
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(self));
+    g_thread_join(self->fetch_thread);
+    self->fetch_thread = NULL;
+
+    while ((output = g_queue_pop_head(&self->out_queue))) {
+        if (output->frame) {
+            mpp_frame_deinit(&output->frame);
+        }
+        g_free(output);
+    }
+    self->out_queued = 0;
 }
 
 static void reset(GstVideoDecoder *decoder, gboolean drain, gboolean final) {
     GstEsDec *self = GST_ES_DEC(decoder);
+    gboolean stalled;
+    guint i;
 
     GST_ES_DEC_LOCK(decoder);
     GST_DEBUG_OBJECT(self, "resetting");
 
     self->is_flushing = TRUE;
     self->is_draining = drain;
-    shut_down(decoder, drain);
+    stalled = shut_down(decoder, drain);
+    stop_fetch_thread(self);
     self->is_flushing = final;
     self->is_draining = FALSE;
-    if (self->mpp_ctx) {
-        esmpp_reset(self->mpp_ctx);
+    for (i = 0; self->mpp_ctx && i < self->n_ctx; i++) {
+        esmpp_reset(GST_ES_DEC_CTX(self, i));
     }
+    self->in_ctx = 0;
+    self->out_ctx = 0;
+    self->eos_ctx = 0;
     self->return_code = GST_FLOW_OK;
     self->frame_cnt = 0;
+    g_array_set_size(self->pending_frames, 0);
+    self->sent_since_output = 0;
+    // a stalled drain lost pictures, the next frame releases them and waits for a sync point
+    self->stalled = stalled;
 
     self->gst_state = 0;
 
@@ -245,6 +443,243 @@ static void reset(GstVideoDecoder *decoder, gboolean drain, gboolean final) {
     GST_ES_DEC_UNLOCK(decoder);
 }
 
+/* fixed output size requested by downstream caps, the scaler only shrinks the picture */
+static gboolean get_caps_scale_size(GstVideoDecoder *decoder, GstVideoCodecState *state, gint *width, gint *height) {
+    GstCaps *allowed;
+    GstStructure *s;
+    gboolean fixed = FALSE;
+
+    allowed = gst_pad_get_allowed_caps(decoder->srcpad);
+    if (allowed && !gst_caps_is_empty(allowed) && !gst_caps_is_any(allowed)) {
+        s = gst_caps_get_structure(allowed, 0);
+        fixed = gst_structure_get_int(s, "width", width) && gst_structure_get_int(s, "height", height);
+    }
+    if (allowed) {
+        gst_caps_unref(allowed);
+    }
+    if (fixed && state && GST_VIDEO_INFO_WIDTH(&state->info) && GST_VIDEO_INFO_HEIGHT(&state->info)) {
+        // only shrink, never upscale in either dimension
+        fixed = *width <= GST_VIDEO_INFO_WIDTH(&state->info) && *height <= GST_VIDEO_INFO_HEIGHT(&state->info)
+                && (*width < GST_VIDEO_INFO_WIDTH(&state->info) || *height < GST_VIDEO_INFO_HEIGHT(&state->info));
+    }
+    if (!fixed) {
+        *width = 0;
+        *height = 0;
+    }
+    return fixed;
+}
+
+/* Extra contexts of an intra-only stream, its frames are independent and go round-robin */
+static void open_sub_contexts(GstEsDec *self) {
+    MppCtxPtr ctx;
+
+    self->n_ctx = 1;
+    if (self->contexts > 1 && self->mpp_coding_type != MPP_VIDEO_CodingMJPEG) {
+        GST_WARNING_OBJECT(self, "only intra-only streams decode on several contexts");
+        return;
+    }
+    while (self->n_ctx < (guint)self->contexts) {
+        ctx = NULL;
+        if (esmpp_create(&ctx, MPP_CTX_DEC, self->mpp_coding_type, 0) != MPP_OK) {
+            break;
+        }
+        if (esmpp_init(ctx) != MPP_OK) {
+            esmpp_destroy(ctx);
+            break;
+        }
+        // same configuration as mpp_ctx
+        if (esmpp_control(ctx, MPP_DEC_SET_CFG, self->mpp_dec_cfg) != MPP_OK || esmpp_open(ctx) != MPP_OK) {
+            esmpp_deinit(ctx);
+            esmpp_destroy(ctx);
+            break;
+        }
+        self->sub_ctx[self->n_ctx - 1] = ctx;
+        self->n_ctx++;
+    }
+    if (self->n_ctx < (guint)self->contexts) {
+        GST_WARNING_OBJECT(self, "opened %u of %d contexts", self->n_ctx, self->contexts);
+    }
+}
+
+/* push the current dec cfg to every context */
+static gboolean apply_dec_cfg(GstEsDec *self) {
+    gboolean ret = TRUE;
+    guint i;
+
+    for (i = 0; i < self->n_ctx; i++) {
+        if (esmpp_control(GST_ES_DEC_CTX(self, i), MPP_DEC_SET_CFG, self->mpp_dec_cfg) != MPP_OK) {
+            ret = FALSE;
+        }
+    }
+    return ret;
+}
+
+static gboolean open_mpp(GstVideoDecoder *decoder, GstVideoCodecState *state) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    MppFrameFormat mpp_fmt;
+
+    if (self->mpp_coding_type != MPP_VIDEO_CodingAVC && self->mpp_coding_type != MPP_VIDEO_CodingHEVC
+        && self->mpp_coding_type != MPP_VIDEO_CodingMJPEG) {
+        GST_ERROR_OBJECT(self, "unsupported coding type %d.", self->mpp_coding_type);
+        return FALSE;
+    }
+    if (esmpp_create(&self->mpp_ctx, MPP_CTX_DEC, self->mpp_coding_type, 0) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to create mpp context.");
+        return FALSE;
+    }
+    if (esmpp_init(self->mpp_ctx) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to init mpp ctx");
+        goto error1;
+    }
+    self->buf_grp = gst_es_allocator_get_mpp_group(self->allocator);
+    if (!self->buf_grp) {
+        GST_ERROR_OBJECT(self, "failed to get buffer group");
+        goto error2;
+    }
+    if (mpp_dec_cfg_init(&self->mpp_dec_cfg) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to init mpp_dec_cfg");
+        goto error2;
+    }
+    if (esmpp_control(self->mpp_ctx, MPP_DEC_GET_CFG, self->mpp_dec_cfg) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to get dec cfg");
+        goto error3;
+    }
+    GST_DEBUG_OBJECT(self, "format is %s", gst_video_format_to_string(self->out_format));
+    mpp_fmt = gst_es_gst_format_to_mpp_format(self->out_format);
+    if (mpp_fmt == MPP_FMT_BUTT) {
+        GST_ERROR_OBJECT(self, "gst %s not support", gst_video_format_to_string(self->out_format));
+        goto error3;
+    }
+    mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "output_fmt", mpp_fmt);
+    if (self->downstream_align > self->stride_align) {
+        // keep the stride downstream asked for in a previous negotiation
+        self->stride_align = self->downstream_align;
+    }
+    if (self->stride_align) {
+        GST_DEBUG_OBJECT(self, "set stride to %u", self->stride_align);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "stride_align", self->stride_align);
+    } else {
+        // If user not set stide align, save it get from mpp
+        mpp_dec_cfg_get_u32(self->mpp_dec_cfg, "stride_align", &self->stride_align);
+        GST_DEBUG_OBJECT(self, "self->stride_align is %u", self->stride_align);
+    }
+    if (self->extra_hw_frames) {
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "extra_hw_frames", self->extra_hw_frames);
+    }
+    if (self->low_latency) {
+        // output in decoding order without waiting to fill the reorder buffer
+        if (mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "fast_out", 1) != MPP_OK) {
+            GST_WARNING_OBJECT(self, "failed to set fast output");
+        }
+    }
+    if (self->out_width && self->out_height) {
+        if ((self->out_width * self->out_height) < 0) {
+            GST_ERROR_OBJECT(self, "width %d height %d not support", self->out_width, self->out_height);
+            goto error3;
+        }
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_width", self->out_width);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_height", self->out_height);
+    } else if (get_caps_scale_size(decoder, state, &self->scale_width, &self->scale_height)) {
+        GST_DEBUG_OBJECT(self, "scale to %dx%d requested by downstream", self->scale_width, self->scale_height);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_width", self->scale_width);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_height", self->scale_height);
+    }
+    if (self->crop_w && self->crop_h) {
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_xoffset", self->crop_x);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_yoffset", self->crop_y);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_width", self->crop_w);
+        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_height", self->crop_h);
+    }
+    if (esmpp_control(self->mpp_ctx, MPP_DEC_SET_CFG, self->mpp_dec_cfg) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to set dec cfg");
+        goto error3;
+    }
+    if (esmpp_open(self->mpp_ctx) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to open esmpp");
+        goto error3;
+    }
+    open_sub_contexts(self);
+    return TRUE;
+
+error3:
+    mpp_dec_cfg_deinit(&self->mpp_dec_cfg);
+error2:
+    esmpp_deinit(self->mpp_ctx);
+error1:
+    esmpp_destroy(self->mpp_ctx);
+    self->mpp_ctx = NULL;
+    return FALSE;
+}
+
+static void join_prepare_thread(GstEsDec *self) {
+    if (!self->prepare_thread) {
+        return;
+    }
+    g_thread_join(self->prepare_thread);
+    self->prepare_thread = NULL;
+}
+
+static void close_mpp(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    MppCtxPtr ctx;
+    guint i;
+
+    join_prepare_thread(self);
+    self->group_buf_count = 0;
+    self->seq_width = 0;
+    self->seq_height = 0;
+    self->info_width = 0;
+    self->info_height = 0;
+    self->dec_grp = NULL;
+
+    for (i = 1; i < self->n_ctx; i++) {
+        ctx = GST_ES_DEC_CTX(self, i);
+        esmpp_close(ctx);
+        esmpp_deinit(ctx);
+        esmpp_destroy(ctx);
+        self->sub_ctx[i - 1] = NULL;
+    }
+    self->n_ctx = 1;
+
+    if (self->mpp_dec_cfg) {
+        mpp_dec_cfg_deinit(&self->mpp_dec_cfg);
+    }
+    if (self->mpp_ctx) {
+        esmpp_close(self->mpp_ctx);
+        esmpp_deinit(self->mpp_ctx);
+        esmpp_destroy(self->mpp_ctx);
+        self->mpp_ctx = NULL;
+    }
+}
+
+static void release_ext_pool(GstEsDec *self) {
+    if (self->ext_pool) {
+        gst_buffer_pool_set_active(self->ext_pool, FALSE);
+        gst_object_unref(self->ext_pool);
+        self->ext_pool = NULL;
+    }
+}
+
+/* only a pool handing out dmabufs can be imported, others would allocate a frame set for nothing */
+static gboolean ext_pool_is_dmabuf(GstBufferPool *pool, GstQuery *query) {
+    GstAllocator *allocator = NULL;
+    GstStructure *config;
+    gboolean ret;
+
+    config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_get_allocator(config, &allocator, NULL);
+    gst_structure_free(config);
+    if (!allocator && gst_query_get_n_allocation_params(query) > 0) {
+        gst_query_parse_nth_allocation_param(query, 0, &allocator, NULL);
+        ret = allocator && !g_strcmp0(allocator->mem_type, GST_ALLOCATOR_DMABUF);
+        if (allocator) {
+            gst_object_unref(allocator);
+        }
+        return ret;
+    }
+    return allocator && !g_strcmp0(allocator->mem_type, GST_ALLOCATOR_DMABUF);
+}
+
 static gboolean gst_es_dec_start(GstVideoDecoder *decoder) {
     GstEsDec *self = GST_ES_DEC(decoder);
 
@@ -255,6 +690,37 @@ static gboolean gst_es_dec_start(GstVideoDecoder *decoder) {
         GST_ERROR_OBJECT(self, "gst_es_allocator_new() failed.");
         return FALSE;
     }
+    self->in_allocator = gst_es_allocator_new(FALSE);
+    if (!self->in_allocator) {
+        GST_ERROR_OBJECT(self, "failed to create input allocator.");
+        gst_object_unref(self->allocator);
+        self->allocator = NULL;
+        return FALSE;
+    }
+    self->pool = NULL;
+    self->in_grp = NULL;
+    self->fetch_thread = NULL;
+    self->out_queued = 0;
+    g_queue_init(&self->out_queue);
+    self->ext_pool = NULL;
+    self->ext_grp = NULL;
+    self->dec_grp = NULL;
+    self->n_ctx = 1;
+    self->in_ctx = 0;
+    self->out_ctx = 0;
+    self->eos_ctx = 0;
+    self->frame_ctx = 0;
+    self->prepare_thread = NULL;
+    self->group_buf_count = 0;
+    self->seq_width = 0;
+    self->seq_height = 0;
+    self->sent_since_output = 0;
+    self->stalled = FALSE;
+    self->downstream_min = 0;
+    self->downstream_align = 0;
+    self->scale_width = 0;
+    self->scale_height = 0;
+    self->caps_changed = FALSE;
 
     self->mpp_coding_type = MPP_VIDEO_CodingUnused;
     self->found_valid_pts = FALSE;
@@ -262,8 +728,14 @@ static gboolean gst_es_dec_start(GstVideoDecoder *decoder) {
     self->return_code = GST_FLOW_OK;
     self->frame_cnt = 0;
     self->is_flushing = FALSE;
+    self->in_seq = 0;
+    self->idle_seq = 0;
+    self->out_seq = 0;
+    self->pending_frames = g_array_new(FALSE, FALSE, sizeof(GstEsDecPendingFrame));
 
     g_mutex_init(&self->mutex);
+    g_mutex_init(&self->event_mutex);
+    g_cond_init(&self->event_cond);
 
     GST_DEBUG_OBJECT(self, "started");
 
@@ -280,18 +752,29 @@ static gboolean gst_es_dec_stop(GstVideoDecoder *decoder) {
     GST_VIDEO_DECODER_STREAM_UNLOCK(decoder);
 
     g_mutex_clear(&self->mutex);
+    g_cond_clear(&self->event_cond);
+    g_mutex_clear(&self->event_mutex);
+    g_array_free(self->pending_frames, TRUE);
+    self->pending_frames = NULL;
 
-    if (self->mpp_dec_cfg) {
-        mpp_dec_cfg_deinit(&self->mpp_dec_cfg);
+    close_mpp(decoder);
+
+    if (self->pool) {
+        gst_es_buffer_pool_clear_external(self->pool);
+        gst_object_unref(self->pool);
+        self->pool = NULL;
     }
-    if (self->mpp_ctx) {
-        esmpp_close(self->mpp_ctx);
-        esmpp_deinit(self->mpp_ctx);
-        esmpp_destroy(self->mpp_ctx);
-        self->mpp_ctx = NULL;
+    release_ext_pool(self);
+    if (self->ext_grp) {
+        mpp_buffer_group_put(self->ext_grp);
+        self->ext_grp = NULL;
+    }
+    if (self->in_grp) {
+        mpp_buffer_group_put(self->in_grp);
+        self->in_grp = NULL;
     }
-
     gst_object_unref(self->allocator);
+    gst_object_unref(self->in_allocator);
 
     if (self->input_state) {
         gst_video_codec_state_unref(self->input_state);
@@ -332,100 +815,129 @@ static GstFlowReturn gst_es_dec_finish(GstVideoDecoder *decoder) {
     return GST_FLOW_OK;
 }
 
+static gboolean codec_data_equal(GstBuffer *a, GstBuffer *b) {
+    GstMapInfo mapinfo;
+    gboolean equal;
+
+    if (a == b) return TRUE;
+    if (!a || !b || gst_buffer_get_size(a) != gst_buffer_get_size(b)) return FALSE;
+    if (!gst_buffer_map(a, &mapinfo, GST_MAP_READ)) return FALSE;
+    equal = !gst_buffer_memcmp(b, 0, mapinfo.data, mapinfo.size);
+    gst_buffer_unmap(a, &mapinfo);
+    return equal;
+}
+
+static gboolean caps_field_equal(GstStructure *a, GstStructure *b, const gchar *field) {
+    return !g_strcmp0(gst_structure_get_string(a, field), gst_structure_get_string(b, field));
+}
+
+/* export the frames as dma-buf with drm format when downstream can import them */
+static GstCaps *get_output_caps(GstVideoDecoder *decoder, GstVideoInfo *info) {
+    GstVideoInfoDmaDrm drm_info;
+    GstCaps *caps = NULL, *allowed;
+
+    if (gst_video_info_dma_drm_from_video_info(&drm_info, info, DRM_FORMAT_MOD_LINEAR)) {
+        caps = gst_video_info_dma_drm_to_caps(&drm_info);
+        allowed = gst_pad_get_allowed_caps(decoder->srcpad);
+        if (caps && (!allowed || !gst_caps_can_intersect(allowed, caps))) {
+            gst_caps_unref(caps);
+            caps = NULL;
+        }
+        if (allowed) {
+            gst_caps_unref(allowed);
+        }
+    }
+    if (!caps) {
+        caps = gst_video_info_to_caps(info);
+    }
+    GST_DEBUG_OBJECT(decoder, "output caps %" GST_PTR_FORMAT, caps);
+    return caps;
+}
+
+/* framerate, pixel-aspect-ratio and the like only affect the output caps */
+static void update_output_state(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstVideoCodecState *output_state;
+    GstVideoInfo info;
+
+    output_state = gst_video_decoder_get_output_state(decoder);
+    if (!output_state) {
+        return;
+    }
+    info = output_state->info;
+    gst_video_codec_state_unref(output_state);
+
+    output_state = gst_video_decoder_set_output_state(
+        decoder, GST_VIDEO_INFO_FORMAT(&info), GST_VIDEO_INFO_WIDTH(&info), GST_VIDEO_INFO_HEIGHT(&info), self->input_state);
+    output_state->caps = get_output_caps(decoder, &output_state->info);
+    gst_video_codec_state_unref(output_state);
+}
+
+/* in low latency mode a frame is output as soon as it is decoded, report one frame */
+static void update_latency(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstVideoInfo *info = &self->input_state->info;
+    GstClockTime latency = 0;
+
+    if (!self->low_latency) {
+        return;
+    }
+    if (GST_VIDEO_INFO_FPS_N(info) > 0 && GST_VIDEO_INFO_FPS_D(info) > 0) {
+        latency = gst_util_uint64_scale(GST_SECOND, GST_VIDEO_INFO_FPS_D(info), GST_VIDEO_INFO_FPS_N(info));
+    }
+    GST_DEBUG_OBJECT(self, "report latency %" GST_TIME_FORMAT, GST_TIME_ARGS(latency));
+    gst_video_decoder_set_latency(decoder, latency, latency);
+}
+
 static gboolean gst_es_dec_set_format(GstVideoDecoder *decoder, GstVideoCodecState *state) {
     GstEsDec *self = GST_ES_DEC(decoder);
+    GstStructure *old_s, *new_s;
 
     GST_DEBUG_OBJECT(self, "setting format: %" GST_PTR_FORMAT, state->caps);
 
-    if (self->input_state) {
-        if (gst_caps_is_strictly_equal(self->input_state->caps, state->caps)) {
-            GST_DEBUG_OBJECT(self, "set the same caps.");
-            return TRUE;
+    if (!self->input_state) {
+        if (!open_mpp(decoder, state)) {
+            return FALSE;
         }
-        GST_DEBUG_OBJECT(self, "get new format, reset decoder");
+        self->input_state = gst_video_codec_state_ref(state);
+        update_latency(decoder);
+        return TRUE;
+    }
+
+    if (gst_caps_is_strictly_equal(self->input_state->caps, state->caps)) {
+        GST_DEBUG_OBJECT(self, "set the same caps.");
+        return TRUE;
+    }
+
+    old_s = gst_caps_get_structure(self->input_state->caps, 0);
+    new_s = gst_caps_get_structure(state->caps, 0);
+    if (!gst_structure_has_name(new_s, gst_structure_get_name(old_s))) {
+        GST_DEBUG_OBJECT(self, "codec changed, reopen decoder");
         reset(decoder, TRUE, FALSE);
+        close_mpp(decoder);
         gst_video_codec_state_unref(self->input_state);
         self->input_state = NULL;
-    } else {
-        MppFrameFormat mpp_fmt;
-        if (self->mpp_coding_type != MPP_VIDEO_CodingAVC && self->mpp_coding_type != MPP_VIDEO_CodingHEVC
-            && self->mpp_coding_type != MPP_VIDEO_CodingMJPEG) {
-            GST_ERROR_OBJECT(self, "unsupported coding type %d.", self->mpp_coding_type);
-            return FALSE;
-        }
-        if (esmpp_create(&self->mpp_ctx, MPP_CTX_DEC, self->mpp_coding_type, 0) != MPP_OK) {
-            GST_ERROR_OBJECT(self, "failed to create mpp context.");
+        if (!open_mpp(decoder, state)) {
             return FALSE;
         }
-        if (esmpp_init(self->mpp_ctx) != MPP_OK) {
-            GST_ERROR_OBJECT(self, "failed to init mpp ctx");
-            goto error1;
-        }
-        self->buf_grp = gst_es_allocator_get_mpp_group(self->allocator);
-        if (!self->buf_grp) {
-            GST_ERROR_OBJECT(self, "failed to get buffer group");
-            goto error2;
-        }
-        if (mpp_dec_cfg_init(&self->mpp_dec_cfg) != MPP_OK) {
-            GST_ERROR_OBJECT(self, "failed to init mpp_dec_cfg");
-            goto error2;
-        }
-        if (esmpp_control(self->mpp_ctx, MPP_DEC_GET_CFG, self->mpp_dec_cfg) != MPP_OK) {
-            GST_ERROR_OBJECT(self, "failed to get dec cfg");
-            goto error3;
-        }
-        GST_DEBUG_OBJECT(self, "format is %s", gst_video_format_to_string(self->out_format));
-        mpp_fmt = gst_es_gst_format_to_mpp_format(self->out_format);
-        if (mpp_fmt == MPP_FMT_BUTT) {
-            GST_ERROR_OBJECT(self, "gst %s not support", gst_video_format_to_string(self->out_format));
-            goto error3;
-        }
-        mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "output_fmt", mpp_fmt);
-        if (self->stride_align) {
-            GST_DEBUG_OBJECT(self, "set stride to %u", self->stride_align);
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "stride_align", self->stride_align);
-        } else {
-            // If user not set stide align, save it get from mpp
-            mpp_dec_cfg_get_u32(self->mpp_dec_cfg, "stride_align", &self->stride_align);
-            GST_DEBUG_OBJECT(self, "self->stride_align is %u", self->stride_align);
-        }
-        if (self->extra_hw_frames) {
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "extra_hw_frames", self->extra_hw_frames);
-        }
-        if (self->out_width && self->out_height) {
-            if ((self->out_width * self->out_height) < 0) {
-                GST_ERROR_OBJECT(self, "width %d height %d not support", self->out_width, self->out_height);
-                goto error3;
-            }
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_width", self->out_width);
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_height", self->out_height);
-        }
-        if (self->crop_w && self->crop_h) {
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_xoffset", self->crop_x);
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_yoffset", self->crop_y);
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_width", self->crop_w);
-            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "crop_height", self->crop_h);
-        }
-        if (esmpp_control(self->mpp_ctx, MPP_DEC_SET_CFG, self->mpp_dec_cfg) != MPP_OK) {
-            GST_ERROR_OBJECT(self, "failed to set dec cfg");
-            goto error3;
-        }
-        if (esmpp_open(self->mpp_ctx) != MPP_OK) {
-            GST_ERROR_OBJECT(self, "failed to open esmpp");
-            goto error3;
-        }
+    } else if (!caps_field_equal(old_s, new_s, "stream-format") || !caps_field_equal(old_s, new_s, "alignment")
+               || !codec_data_equal(self->input_state->codec_data, state->codec_data)) {
+        // the task restarts on the next frame and sends the new extradata
+        GST_DEBUG_OBJECT(self, "stream config changed, drain and reset decoder");
+        reset(decoder, TRUE, FALSE);
+        gst_video_codec_state_unref(self->input_state);
+        self->input_state = NULL;
+    } else {
+        GST_DEBUG_OBJECT(self, "caps changed without affecting the decoder");
+        gst_video_codec_state_unref(self->input_state);
+        self->input_state = gst_video_codec_state_ref(state);
+        update_output_state(decoder);
+        update_latency(decoder);
+        return TRUE;
     }
     self->input_state = gst_video_codec_state_ref(state);
+    update_latency(decoder);
     return TRUE;
-
-error3:
-    mpp_dec_cfg_deinit(&self->mpp_dec_cfg);
-error2:
-    esmpp_deinit(self->mpp_ctx);
-error1:
-    esmpp_destroy(self->mpp_ctx);
-    self->mpp_ctx = NULL;
-    return FALSE;
 }
 
 static gboolean update_video_info(GstVideoDecoder *decoder,
@@ -443,20 +955,21 @@ static gboolean update_video_info(GstVideoDecoder *decoder,
 
     output_state = gst_video_decoder_set_output_state(
         decoder, gst_format, GST_ROUND_UP_2(width), GST_ROUND_UP_2(height), self->input_state);
-    output_state->caps = gst_video_info_to_caps(&output_state->info);
+    output_state->caps = get_output_caps(decoder, &output_state->info);
 
     *gst_info = output_state->info;
     gst_video_codec_state_unref(output_state);
 
-    if (!gst_video_decoder_negotiate(decoder)) return FALSE;
-
     align = align ? align : 2;
     hstride = hstride ? hstride : GST_ES_VIDEO_INFO_HSTRIDE(gst_info);
     hstride = GST_ROUND_UP_N(hstride, align);
     vstride = vstride ? vstride : GST_ES_VIDEO_INFO_VSTRIDE(gst_info);
     vstride = GST_ROUND_UP_N(vstride, 2);
 
-    return gst_es_video_info_align(gst_info, hstride, vstride);
+    if (!gst_es_video_info_align(gst_info, hstride, vstride, align)) return FALSE;
+
+    // the aligned info sizes the output pool in decide_allocation
+    return gst_video_decoder_negotiate(decoder);
 }
 
 static GstFlowReturn apply_info_change(GstVideoDecoder *decoder, MppFramePtr mpp_frame) {
@@ -478,100 +991,328 @@ static GstFlowReturn apply_info_change(GstVideoDecoder *decoder, MppFramePtr mpp
     return GST_FLOW_OK;
 }
 
-static GstVideoCodecFrame *get_gst_frame(GstVideoDecoder *decoder, GstClockTime pts) {
+/* index of the first pending frame whose pts is not less than pts, invalid pts sort last */
+static guint pending_frame_lower_bound(GArray *pending, GstClockTime pts) {
+    guint lo = 0, hi = pending->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (g_array_index(pending, GstEsDecPendingFrame, mid).pts < pts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void add_pending_frame(GstEsDec *self, GstVideoCodecFrame *frame) {
+    GstEsDecPendingFrame entry = {frame->pts, frame->system_frame_number};
+    guint idx = self->pending_frames->len;
+
+    // frames with the same pts stay in decoding order
+    if (GST_CLOCK_TIME_IS_VALID(frame->pts)) {
+        idx = pending_frame_lower_bound(self->pending_frames, frame->pts + 1);
+    }
+    g_array_insert_val(self->pending_frames, idx, entry);
+}
+
+static void remove_pending_frame(GstEsDec *self, guint32 frame_number) {
+    guint i;
+
+    for (i = 0; i < self->pending_frames->len; i++) {
+        if (g_array_index(self->pending_frames, GstEsDecPendingFrame, i).frame_number == frame_number) {
+            g_array_remove_index(self->pending_frames, i);
+            return;
+        }
+    }
+}
+
+/* frames before idx are displayed earlier than the matched frame but were decoded before it,
+ * the hardware will never output them, release them so they do not pile up */
+static guint reap_pending_frames(GstVideoDecoder *decoder, guint idx, guint32 frame_number) {
     GstEsDec *self = GST_ES_DEC(decoder);
     GstVideoCodecFrame *gst_frame;
-    GList *frame_list, *l;
-    gboolean first_frame = !self->frame_cnt;
-    gint i;
+    guint i = 0;
 
-    self->frame_cnt++;
+    while (i < idx) {
+        GstEsDecPendingFrame *entry = &g_array_index(self->pending_frames, GstEsDecPendingFrame, i);
+        if (entry->frame_number >= frame_number) {
+            i++;
+            continue;
+        }
+        GST_DEBUG_OBJECT(self, "release frame #%u dropped by hardware", entry->frame_number);
+        gst_frame = gst_video_decoder_get_frame(decoder, entry->frame_number);
+        if (gst_frame) {
+            gst_video_decoder_release_frame(decoder, gst_frame);
+        }
+        g_array_remove_index(self->pending_frames, i);
+        idx--;
+    }
+    return idx;
+}
 
-    frame_list = gst_video_decoder_get_frames(decoder);
-    if (!frame_list) {
-        return NULL;
+/* index of the pending frame to output for pts, pending->len if there is none */
+static guint find_pending_frame(GstVideoDecoder *decoder, GstClockTime pts) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GArray *pending = self->pending_frames;
+    GstEsDecPendingFrame *entry;
+    guint idx;
+
+    if (GST_CLOCK_TIME_IS_VALID(pts)) {
+        idx = pending_frame_lower_bound(pending, pts > PTS_MATCH_TOLERANCE ? pts - PTS_MATCH_TOLERANCE + 1 : 0);
+        if (idx < pending->len) {
+            entry = &g_array_index(pending, GstEsDecPendingFrame, idx);
+            if (GST_CLOCK_TIME_IS_VALID(entry->pts) && entry->pts < pts + PTS_MATCH_TOLERANCE) {
+                GST_TRACE_OBJECT(self, "using matched frame (#%u)", entry->frame_number);
+                return reap_pending_frames(decoder, idx, entry->frame_number);
+            }
+        }
+    }
+
+    // no match, use the earliest frame not displayed after pts, else the first one without pts
+    entry = &g_array_index(pending, GstEsDecPendingFrame, 0);
+    if (!GST_CLOCK_TIME_IS_VALID(pts) || entry->pts <= pts) {
+        return 0;
     }
+    return pending_frame_lower_bound(pending, GST_CLOCK_TIME_NONE);
+}
+
+/* output buffers held outside of the decoder besides the ones mpp references */
+static guint get_display_buf_count(GstEsDec *self) {
+    if (self->mem_optimize) {
+        // only what downstream asked for, plus the frame being pushed
+        return MAX(self->downstream_min, 1);
+    }
+    return MAX(self->downstream_min, DISPLAY_BUFFER_CNT);
+}
+
+static GstVideoCodecFrame *get_gst_frame(GstVideoDecoder *decoder, GstClockTime pts) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GArray *pending = self->pending_frames;
+    GstVideoCodecFrame *gst_frame = NULL;
+    gboolean first_frame = !self->frame_cnt;
+    guint32 frame_number;
+    guint idx;
+
+    self->frame_cnt++;
 
     if (first_frame) {
-        gst_frame = frame_list->data;
-        GST_DEBUG_OBJECT(self, "using original pts, using first frame (#%d)", gst_frame->system_frame_number);
-        goto out;
+        GST_DEBUG_OBJECT(self, "using original pts, using first frame");
+        goto oldest;
     }
 
     if (!pts) {
         pts = GST_CLOCK_TIME_NONE;
     }
 
-    GST_TRACE_OBJECT(self, "receiving pts=%" GST_TIME_FORMAT, GST_TIME_ARGS(pts));
+    GST_TRACE_OBJECT(self, "receiving pts=%" GST_TIME_FORMAT, GST_TIME_ARGS(pts));
+
+    // frames come out in decoding order, no need to search
+    if (!self->found_valid_pts || self->low_latency) {
+        goto oldest;
+    }
+
+    while (!gst_frame && pending->len) {
+        idx = find_pending_frame(decoder, pts);
+        if (idx >= pending->len) {
+            break;
+        }
+        frame_number = g_array_index(pending, GstEsDecPendingFrame, idx).frame_number;
+        g_array_remove_index(pending, idx);
+        // the frame may have been finished by the base class already, try the next one then
+        gst_frame = gst_video_decoder_get_frame(decoder, frame_number);
+    }
+    goto out;
+
+oldest:
+    gst_frame = gst_video_decoder_get_oldest_frame(decoder);
+    if (gst_frame) {
+        GST_DEBUG_OBJECT(self, "using oldest frame (#%d)", gst_frame->system_frame_number);
+        remove_pending_frame(self, gst_frame->system_frame_number);
+    }
+out:
+    if (gst_frame && GST_CLOCK_TIME_IS_VALID(pts)) {
+        gst_frame->pts = pts;
+    }
+    return gst_frame;
+}
+
+/* Decode straight into the buffers of the downstream pool, they stay acquired
+ * and imported into ext_grp until the next info change.
+ */
+static gboolean import_ext_pool(GstEsDec *self, MppCtxPtr ctx, guint buf_size, guint count) {
+    GstStructure *config;
+    GstBuffer *buffer;
+    GstCaps *caps;
+    guint i;
+
+    if (!self->ext_grp && mpp_buffer_group_get_external(&self->ext_grp, MPP_BUFFER_TYPE_DMA_HEAP)) {
+        GST_WARNING_OBJECT(self, "failed to get external buffer group");
+        self->ext_grp = NULL;
+        goto fallback;
+    }
+    gst_es_buffer_pool_clear_external(self->pool);
+    mpp_buffer_group_clear(self->ext_grp);
+
+    caps = gst_pad_get_current_caps(GST_VIDEO_DECODER_SRC_PAD(self));
+    config = gst_buffer_pool_get_config(self->ext_pool);
+    // no minimum, a pool that turns out not to be importable only allocated the first buffer
+    gst_buffer_pool_config_set_params(config, caps, MAX(buf_size, GST_VIDEO_INFO_SIZE(&self->gst_info)), 0, count);
+    if (caps) {
+        gst_caps_unref(caps);
+    }
+    if (!gst_buffer_pool_set_config(self->ext_pool, config) || !gst_buffer_pool_set_active(self->ext_pool, TRUE)) {
+        GST_WARNING_OBJECT(self, "downstream pool rejected %u buffers of %u bytes", count, buf_size);
+        goto fallback;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (gst_buffer_pool_acquire_buffer(self->ext_pool, &buffer, NULL) != GST_FLOW_OK) {
+            GST_WARNING_OBJECT(self, "failed to acquire downstream buffer %u of %u", i, count);
+            goto fallback;
+        }
+        if (!gst_es_buffer_pool_import_external(self->pool, self->ext_grp, buffer, buf_size)) {
+            goto fallback;
+        }
+    }
+
+    if (esmpp_control(ctx, MPP_DEC_SET_EXT_BUF_GROUP, self->ext_grp) != MPP_OK) {
+        GST_WARNING_OBJECT(self, "failed to set external buffer group");
+        goto fallback;
+    }
+    GST_INFO_OBJECT(self, "decoding into %u downstream buffers", count);
+    return TRUE;
+
+fallback:
+    // mpp allocates its own buffers from now on
+    gst_es_buffer_pool_clear_external(self->pool);
+    if (self->ext_grp) {
+        mpp_buffer_group_clear(self->ext_grp);
+    }
+    release_ext_pool(self);
+    return FALSE;
+}
+
+typedef struct {
+    GstEsDec *self;
+    MppBufferGroupPtr group;
+    gsize size;
+    guint count;
+} GstEsDecPrepare;
+
+/* Allocate the buffers of an announced sequence while the current one drains.
+ * They go to the allocator group the pool and mpp already use, mpp reuses
+ * unused buffers of the group that are large enough.
+ */
+static gpointer prepare_loop(gpointer data) {
+    GstEsDecPrepare *prepare = data;
+    MppBufferPtr *bufs;
+    guint i;
+
+    bufs = g_new0(MppBufferPtr, prepare->count);
+    for (i = 0; i < prepare->count; i++) {
+        mpp_buffer_get(prepare->group, &bufs[i], prepare->size);
+        if (!bufs[i]) break;
+    }
+    // back to the unused list, where mpp picks them up after the info change
+    for (i = 0; i < prepare->count && bufs[i]; i++) {
+        mpp_buffer_put(bufs[i]);
+    }
+    g_free(bufs);
+    GST_DEBUG_OBJECT(prepare->self, "prepared %u buffers of %" G_GSIZE_FORMAT " bytes", i, prepare->size);
+    g_free(prepare);
+    return NULL;
+}
+
+/* Called under the stream lock, the allocation runs on its own thread so that
+ * neither input nor flush waits for it.
+ */
+static void prepare_next_group(GstEsDec *self, gint width, gint height) {
+    GstEsDecPrepare *prepare;
+    GstVideoInfo info;
+
+    if (self->prepare_thread) {
+        GST_DEBUG_OBJECT(self, "still preparing the previous sequence");
+        return;
+    }
+
+    // size for the coarsest alignment mpp may pick
+    gst_video_info_set_format(&info, self->out_format, width, height);
+    if (!gst_es_video_info_align(&info,
+                                 GST_ES_ALIGN_N(GST_ES_VIDEO_INFO_HSTRIDE(&info), MAX(self->stride_align, 64)),
+                                 GST_ROUND_UP_N(height, 64),
+                                 0)) {
+        return;
+    }
+    prepare = g_new0(GstEsDecPrepare, 1);
+    prepare->self = self;
+    prepare->group = self->buf_grp;
+    prepare->size = GST_VIDEO_INFO_SIZE(&info);
+    prepare->count = self->group_buf_count;
+    self->next_buf_size = prepare->size;
+    GST_DEBUG_OBJECT(self, "preparing %u buffers for %dx%d", prepare->count, width, height);
+    self->prepare_thread = g_thread_new("esdec-prepare", prepare_loop, prepare);
+}
+
+static void wait_next_group(GstEsDec *self, guint buf_size) {
+    if (!self->prepare_thread) {
+        return;
+    }
+    // waits at most for the rest of an allocation mpp would do here anyway
+    join_prepare_thread(self);
+    if (buf_size > self->next_buf_size) {
+        GST_DEBUG_OBJECT(self, "prepared buffers too small, %u > %" G_GSIZE_FORMAT, buf_size, self->next_buf_size);
+    }
+}
+
+/* A new sps on input announces the next info change ahead of mpp. Only the
+ * buffers are prepared: the output caps carry the strides and size mpp reports
+ * with the info change, and pictures of the draining sequence still go out
+ * under the current caps, so renegotiation stays at the info change.
+ */
+static void check_sequence(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
+    GstEsDec *self = GST_ES_DEC(decoder);
+    gint width, height;
+    gboolean first;
 
-    if (!self->found_valid_pts) {
-        gst_frame = frame_list->data;
-        GST_DEBUG_OBJECT(self, "using oldest frame (#%d)", gst_frame->system_frame_number);
-        goto out;
+    if (!klass->get_sequence_size || !klass->get_sequence_size(decoder, frame, &width, &height)) {
+        return;
     }
-
-    for (gst_frame = NULL, l = frame_list, i = 0; l != NULL; l = l->next, i++) {
-        GstVideoCodecFrame *f = l->data;
-        if (GST_CLOCK_TIME_IS_VALID(f->pts)) {
-            if (abs((gint)f->pts - (gint)pts) < 3 * GST_MSECOND) {
-                gst_frame = f;
-                GST_TRACE_OBJECT(self, "using matched frame (#%d)", gst_frame->system_frame_number);
-                goto out;
-            }
-            if (GST_CLOCK_TIME_IS_VALID(pts) && f->pts > pts) {
-                continue;
-            }
-        }
-        if (!gst_frame || gst_frame->pts > f->pts) {
-            gst_frame = f;
-        }
+    if (width == self->seq_width && height == self->seq_height) {
+        return;
     }
-
-out:
-    if (gst_frame) {
-        gst_video_codec_frame_ref(gst_frame);
-        if (GST_CLOCK_TIME_IS_VALID(pts)) {
-            gst_frame->pts = pts;
-        }
+    GST_DEBUG_OBJECT(self, "sequence %dx%d on input, was %dx%d", width, height, self->seq_width, self->seq_height);
+    first = !self->seq_width;
+    self->seq_width = width;
+    self->seq_height = height;
+
+    // nothing to prepare for the first sequence, scaled output or buffers provided by downstream
+    if (first || !self->group_buf_count || self->mem_optimize || self->ext_pool || self->out_width
+        || self->scale_width) {
+        return;
     }
-
-    g_list_free_full(frame_list, (GDestroyNotify)gst_video_codec_frame_unref);
-    return gst_frame;
+    prepare_next_group(self, width, height);
 }
 
 static GstBuffer *get_gst_buffer(GstVideoDecoder *decoder, MppFramePtr mpp_frame) {
     GstEsDec *self = GST_ES_DEC(decoder);
     GstVideoInfo *gst_info = &self->gst_info;
-    GstBuffer *gst_buffer;
-    GstMemory *gst_mem;
+    GstBuffer *gst_buffer = NULL;
     MppBufferPtr mpp_buffer;
 
     mpp_buffer = mpp_frame_get_buffer(mpp_frame);
-    if (!mpp_buffer) {
+    if (!mpp_buffer || !self->pool) {
         return NULL;
     }
 
     mpp_buffer_set_index(mpp_buffer, gst_es_allocator_get_index(self->allocator));
-    gst_mem = gst_es_allocator_import_mppbuf(self->allocator, mpp_buffer);
-    if (!gst_mem) {
-        return NULL;
-    }
-
-    gst_buffer = gst_buffer_new();
-    if (!gst_buffer) {
-        gst_memory_unref(gst_mem);
+    // reuse the wrapper of this mpp buffer if it has been output before
+    if (gst_es_buffer_pool_acquire_mpp_buffer(self->pool, mpp_buffer, gst_info, &gst_buffer) != GST_FLOW_OK) {
+        GST_WARNING_OBJECT(self, "failed to acquire buffer from pool");
         return NULL;
     }
-
-    gst_buffer_append_memory(gst_buffer, gst_mem);
-    gst_buffer_add_video_meta_full(gst_buffer,
-                                   GST_VIDEO_FRAME_FLAG_NONE,
-                                   GST_VIDEO_INFO_FORMAT(gst_info),
-                                   GST_VIDEO_INFO_WIDTH(gst_info),
-                                   GST_VIDEO_INFO_HEIGHT(gst_info),
-                                   GST_VIDEO_INFO_N_PLANES(gst_info),
-                                   gst_info->offset,
-                                   gst_info->stride);
     return gst_buffer;
 }
 
@@ -612,17 +1353,102 @@ static void memset_padding_width(GstEsDec *self, MppFramePtr mpp_frame) {
     return;
 }
 
-static void gst_es_dec_loop(GstVideoDecoder *decoder) {
+/* frames outside of the segment are not going to be shown */
+static gboolean frame_before_segment(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstSegment *segment = &decoder->input_segment;
+    GstClockTime end;
+
+    if (segment->format != GST_FORMAT_TIME || segment->rate < 0.0 || !GST_CLOCK_TIME_IS_VALID(frame->pts)) {
+        return FALSE;
+    }
+    end = frame->pts;
+    if (GST_CLOCK_TIME_IS_VALID(frame->duration)) {
+        end += frame->duration;
+    }
+    // same rule as gst_segment_clip
+    return end < segment->start || (end == segment->start && frame->pts != segment->start);
+}
+
+/* in trick modes only decode what is going to be shown */
+static gboolean skip_for_trickmode(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
+    GstSegmentFlags flags = decoder->input_segment.flags;
+
+    if (flags & GST_SEGMENT_FLAG_TRICKMODE_KEY_UNITS) {
+        return !GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT(frame);
+    }
+    if (flags & GST_SEGMENT_FLAG_TRICKMODE) {
+        return klass->frame_is_droppable && klass->frame_is_droppable(decoder, frame);
+    }
+    return FALSE;
+}
+
+/* late for display according to qos, and nothing depends on it */
+static gboolean frame_is_late(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
+
+    if (gst_video_decoder_get_max_decode_time(decoder, frame) >= 0) {
+        return FALSE;
+    }
+    return klass->frame_is_droppable && klass->frame_is_droppable(decoder, frame);
+}
+
+/* Finish the frames a subclass completed without mpp, once every frame before them is out */
+static void finish_ready_frames(GstVideoDecoder *decoder) {
+    GstVideoCodecFrame *frame;
+
+    while ((frame = gst_video_decoder_get_oldest_frame(decoder))) {
+        if (!frame->output_buffer) {
+            gst_video_codec_frame_unref(frame);
+            break;
+        }
+        gst_video_decoder_finish_frame(decoder, frame);
+    }
+}
+
+/* input is pending but mpp returned nothing for the whole watchdog budget */
+static gboolean output_stalled(GstEsDec *self, gboolean input_blocked) {
+    if (!self->watchdog || !self->sent_since_output) {
+        return FALSE;
+    }
+    if (g_get_monotonic_time() - self->last_output < (gint64)self->watchdog * G_TIME_SPAN_MILLISECOND) {
+        return FALSE;
+    }
+    return input_blocked || self->sent_since_output > WATCHDOG_PACKETS;
+}
+
+/* poll mpp once, ctx is set to the context the frame came from */
+static MppFramePtr fetch_mpp_frame(GstVideoDecoder *decoder, guint *ctx) {
     GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
     GstEsDec *self = GST_ES_DEC(decoder);
-    GstVideoCodecFrame *gst_frame = NULL;
-    GstBuffer *gst_buffer = NULL;
     MppFramePtr mpp_frame = NULL;
+    guint32 in_seq = self->in_seq;
 
     mpp_frame = klass->get_mpp_frame(decoder, OUT_TIMEOUT_MS);
+    *ctx = self->frame_ctx;
+
+    // mpp may have freed input slots, wake up the blocked input side
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(decoder));
+    self->out_seq++;
     if (!mpp_frame) {
-        return;
+        self->idle_seq = in_seq;
+    }
+    g_cond_broadcast(GST_ES_DEC_EVENT_COND(decoder));
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(decoder));
+
+    if (!mpp_frame && output_stalled(self, FALSE)) {
+        GST_WARNING_OBJECT(self, "no output for %u packets, hardware stalled", self->sent_since_output);
+        self->stalled = TRUE;
     }
+    return mpp_frame;
+}
+
+/* handle a frame fetched from context ctx and push the picture downstream */
+static void push_mpp_frame(GstVideoDecoder *decoder, MppFramePtr mpp_frame, guint ctx_index) {
+    GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstVideoCodecFrame *gst_frame = NULL;
+    GstBuffer *gst_buffer = NULL;
 
     GST_VIDEO_DECODER_STREAM_LOCK(decoder);
 
@@ -632,16 +1458,33 @@ static void gst_es_dec_loop(GstVideoDecoder *decoder) {
     }
 
     if (mpp_frame_get_info_change(mpp_frame)) {
+        MppCtxPtr ctx = GST_ES_DEC_CTX(self, ctx_index);
         ES_U32 width = mpp_frame_get_width(mpp_frame);
         ES_U32 height = mpp_frame_get_height(mpp_frame);
         ES_U32 hor_stride = mpp_frame_get_hor_stride(mpp_frame);
         ES_U32 ver_stride = mpp_frame_get_ver_stride(mpp_frame);
         ES_U32 buf_size = mpp_frame_get_buf_size(mpp_frame);
-        // Reserve additional buffers for display
-        ES_U32 group_buf_count = mpp_frame_get_group_buf_count(mpp_frame) + DISPLAY_BUFFER_CNT;
+        ES_U32 group_buf_count;
+
+        if (self->n_ctx > 1 && self->dec_grp && (gint)width == self->info_width && (gint)height == self->info_height) {
+            // another context reached the picture size the group is set up for
+            GST_DEBUG_OBJECT(self, "context %u info changed to the current %ux%u", ctx_index, width, height);
+            esmpp_control(ctx, MPP_DEC_SET_EXT_BUF_GROUP, self->dec_grp);
+            esmpp_control(ctx, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
+            goto info_change_frame;
+        }
+
+        // negotiate first, so that the downstream requirement is known when sizing the group
+        self->return_code = apply_info_change(decoder, mpp_frame);
+
+        // Reserve additional buffers for display, every context holds its own references
+        group_buf_count = mpp_frame_get_group_buf_count(mpp_frame) * self->n_ctx + get_display_buf_count(self);
         if (self->extra_hw_frames) {
             group_buf_count += self->extra_hw_frames;
         }
+        group_buf_count += self->held_buffers;
+        // pictures waiting in the output queue keep their buffers
+        group_buf_count += self->output_queue_size;
 
         GST_DEBUG_OBJECT(self,
                          "info changed found. Require buffer w:h [%u:%u] stride [%u:%u] buf_size[%u] buf_cnt[%u]",
@@ -651,10 +1494,18 @@ static void gst_es_dec_loop(GstVideoDecoder *decoder) {
                          ver_stride,
                          buf_size,
                          group_buf_count);
-        mpp_buffer_group_limit_config(self->buf_grp, buf_size, group_buf_count);
-        esmpp_control(self->mpp_ctx, MPP_DEC_SET_EXT_BUF_GROUP, self->buf_grp);
-        esmpp_control(self->mpp_ctx, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
-        self->return_code = apply_info_change(decoder, mpp_frame);
+        if (self->ext_pool && import_ext_pool(self, ctx, buf_size, group_buf_count)) {
+            self->dec_grp = self->ext_grp;
+        } else {
+            wait_next_group(self, buf_size);
+            mpp_buffer_group_limit_config(self->buf_grp, buf_size, group_buf_count);
+            esmpp_control(ctx, MPP_DEC_SET_EXT_BUF_GROUP, self->buf_grp);
+            self->dec_grp = self->buf_grp;
+        }
+        self->group_buf_count = group_buf_count;
+        self->info_width = width;
+        self->info_height = height;
+        esmpp_control(ctx, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
         goto info_change_frame;
     }
 
@@ -672,6 +1523,16 @@ static void gst_es_dec_loop(GstVideoDecoder *decoder) {
         goto error;
     }
 
+    // drop before wrapping the buffer
+    if (self->is_flushing && !self->is_draining) {
+        GST_DEBUG_OBJECT(self, "is flushing and not draining, drop frame");
+        goto drop_frame;
+    }
+    if (frame_before_segment(decoder, gst_frame)) {
+        GST_DEBUG_OBJECT(self, "frame before segment start, drop frame");
+        goto drop_frame;
+    }
+
     gst_buffer = get_gst_buffer(decoder, mpp_frame);
     if (!gst_buffer) {
         goto error;
@@ -689,16 +1550,18 @@ static void gst_es_dec_loop(GstVideoDecoder *decoder) {
     GST_MINI_OBJECT_FLAG_SET(gst_buffer, GST_MINI_OBJECT_FLAG_LOCKABLE);
     gst_frame->output_buffer = gst_buffer;
 
-    if (self->is_flushing && !self->is_draining) {
-        GST_DEBUG_OBJECT(self, "is flushing and not draining, drop frame");
-        goto drop_frame;
+    if (klass->frame_decoded) {
+        klass->frame_decoded(decoder, gst_frame);
     }
-
     GST_TRACE_OBJECT(self, "Call finish frame, pts=%" GST_TIME_FORMAT, GST_TIME_ARGS(gst_frame->pts));
     gst_video_decoder_finish_frame(decoder, gst_frame);
 
 out:
+    finish_ready_frames(decoder);
     mpp_frame_deinit(&mpp_frame);
+    // counted after pushing, time blocked downstream is no stall
+    self->last_output = g_get_monotonic_time();
+    self->sent_since_output = 0;
 
     if (self->return_code != GST_FLOW_OK) {
         GST_DEBUG_OBJECT(self, "leaving output thread: %s", gst_flow_get_name(self->return_code));
@@ -727,15 +1590,237 @@ drop_frame:
     goto out;
 }
 
+/* the frame of a picture dropped from the output queue is dropped too, posting qos */
+static void drop_output(GstVideoDecoder *decoder, ES_S64 pts) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstVideoCodecFrame *gst_frame;
+
+    GST_VIDEO_DECODER_STREAM_LOCK(decoder);
+    gst_frame = get_gst_frame(decoder, pts);
+    if (gst_frame) {
+        GST_DEBUG_OBJECT(self, "drop frame %u, output queue was full", gst_frame->system_frame_number);
+        gst_video_decoder_drop_frame(decoder, gst_frame);
+    }
+    finish_ready_frames(decoder);
+    GST_VIDEO_DECODER_STREAM_UNLOCK(decoder);
+}
+
+/* src pad task with a fetch thread, push what it queued */
+static void push_queued_output(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstEsDecOutput *output;
+
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(decoder));
+    while (g_queue_is_empty(&self->out_queue) && !(self->is_flushing && !self->is_draining)) {
+        g_cond_wait(GST_ES_DEC_EVENT_COND(decoder), GST_ES_DEC_EVENT_MUTEX(decoder));
+    }
+    output = g_queue_pop_head(&self->out_queue);
+    if (output && output->picture) {
+        self->out_queued--;
+    }
+    // a fetch thread blocked on a full queue goes on
+    g_cond_broadcast(GST_ES_DEC_EVENT_COND(decoder));
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(decoder));
+    if (!output) {
+        return;
+    }
+
+    if (output->frame) {
+        push_mpp_frame(decoder, output->frame, output->ctx);
+    } else {
+        drop_output(decoder, output->pts);
+    }
+    g_free(output);
+}
+
+static void gst_es_dec_loop(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    MppFramePtr mpp_frame;
+    guint ctx;
+
+    if (self->fetch_thread) {
+        push_queued_output(decoder);
+        return;
+    }
+
+    // sleep until a packet is queued since the last empty poll, or flush/eos
+    GST_ES_DEC_WAIT(decoder, self->in_seq != self->idle_seq || self->is_flushing);
+    if (self->is_flushing && !self->is_draining) {
+        return;
+    }
+    mpp_frame = fetch_mpp_frame(decoder, &ctx);
+    if (mpp_frame) {
+        push_mpp_frame(decoder, mpp_frame, ctx);
+    }
+}
+
+static gboolean is_picture(MppFramePtr mpp_frame) {
+    return !mpp_frame_get_eos(mpp_frame) && !mpp_frame_get_info_change(mpp_frame);
+}
+
+/* under the event mutex, a full queue makes room following the drop policy */
+static void queue_output(GstEsDec *self, MppFramePtr mpp_frame, guint ctx) {
+    GstEsDecOutput *output = g_new0(GstEsDecOutput, 1);
+    GstEsDecOutput *victim = NULL;
+    GList *l;
+
+    output->frame = mpp_frame;
+    output->pts = mpp_frame_get_pts(mpp_frame);
+    output->ctx = ctx;
+    output->picture = is_picture(mpp_frame);
+
+    if (output->picture && self->out_queued >= (guint)self->output_queue_size) {
+        if (self->drop_policy == GST_ES_DEC_DROP_OLDEST) {
+            for (l = self->out_queue.head; l && !victim; l = l->next) {
+                if (((GstEsDecOutput *)l->data)->picture) victim = l->data;
+            }
+            if (victim) self->out_queued--;
+        } else if (self->drop_policy == GST_ES_DEC_DROP_NEWEST) {
+            victim = output;
+        }
+    }
+    // the buffer goes back to mpp, the frame is dropped when its turn to push comes
+    if (victim) {
+        mpp_frame_deinit(&victim->frame);
+        victim->picture = FALSE;
+    }
+    if (output->picture) {
+        self->out_queued++;
+    }
+    g_queue_push_tail(&self->out_queue, output);
+    g_cond_broadcast(GST_ES_DEC_EVENT_COND(self));
+}
+
+/* Drain mpp into the output queue, so that the hardware keeps decoding
+ * while the src pad task is blocked downstream.
+ */
+static gpointer fetch_loop(gpointer data) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(data);
+    GstEsDec *self = GST_ES_DEC(decoder);
+    MppFramePtr mpp_frame;
+    gboolean input, room;
+    guint ctx;
+
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(self));
+    while (self->fetching) {
+        // a packet queued since the last empty poll, or flush/eos
+        input = self->in_seq != self->idle_seq || self->is_flushing;
+        room = self->drop_policy != GST_ES_DEC_DROP_NONE || self->out_queued < (guint)self->output_queue_size;
+        if (!input || !room || (self->is_flushing && !self->is_draining)) {
+            g_cond_wait(GST_ES_DEC_EVENT_COND(self), GST_ES_DEC_EVENT_MUTEX(self));
+            continue;
+        }
+        g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(self));
+        mpp_frame = fetch_mpp_frame(decoder, &ctx);
+        g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(self));
+        if (mpp_frame) {
+            queue_output(self, mpp_frame, ctx);
+        }
+    }
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(self));
+    return NULL;
+}
+
+static void start_fetch_thread(GstEsDec *self) {
+    if (!self->output_queue_size || self->fetch_thread) {
+        return;
+    }
+    self->fetching = TRUE;
+    self->fetch_thread = g_thread_new("esdec-fetch", fetch_loop, self);
+}
+
+/* follow a new downstream size with the hardware scaler */
+static void update_caps_scale(GstVideoDecoder *decoder) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    gint width = 0, height = 0;
+
+    if ((self->out_width && self->out_height) || !self->mpp_ctx
+        || !g_atomic_int_compare_and_exchange(&self->caps_changed, TRUE, FALSE)) {
+        return;
+    }
+    get_caps_scale_size(decoder, self->input_state, &width, &height);
+    if (width == self->scale_width && height == self->scale_height) {
+        return;
+    }
+
+    GST_DEBUG_OBJECT(self, "downstream size changed to %dx%d, drain and rescale", width, height);
+    reset(decoder, TRUE, FALSE);
+    self->scale_width = width;
+    self->scale_height = height;
+    mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_width", width);
+    mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "scale_height", height);
+    if (!apply_dec_cfg(self)) {
+        GST_WARNING_OBJECT(self, "failed to set scale size");
+    }
+}
+
+/* The contexts share one group set up for one picture size. Pictures of the
+ * old size still in flight on other contexts would go out with the layout of
+ * the new one, so a batch of another size waits for them to drain.
+ */
+static void drain_for_size_change(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
+    GstEsDec *self = GST_ES_DEC(decoder);
+    gint width, height;
+
+    if (self->n_ctx < 2 || !self->seq_width || !klass->get_sequence_size
+        || !klass->get_sequence_size(decoder, frame, &width, &height)) {
+        return;
+    }
+    if (width == self->seq_width && height == self->seq_height) {
+        return;
+    }
+    GST_DEBUG_OBJECT(self, "size changed to %dx%d on %u contexts, drain first", width, height, self->n_ctx);
+    reset(decoder, TRUE, FALSE);
+}
+
+/* Reset a stalled context in place, the task restarts with the extradata on
+ * this frame and upstream is asked for a sync point to resume from.
+ */
+static void recover_stall(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GList *frames, *l;
+
+    GST_ELEMENT_WARNING(self,
+                        STREAM,
+                        DECODE,
+                        ("Decoder stalled, resetting it"),
+                        ("no output for %d ms after %u packets", self->watchdog, self->sent_since_output));
+    reset(decoder, FALSE, FALSE);
+
+    // frames queued in the stalled context never come back
+    frames = gst_video_decoder_get_frames(decoder);
+    for (l = frames; l; l = l->next) {
+        if (l->data != frame) {
+            gst_video_decoder_release_frame(decoder, gst_video_codec_frame_ref(l->data));
+        }
+    }
+    g_list_free_full(frames, (GDestroyNotify)gst_video_codec_frame_unref);
+
+    gst_video_decoder_request_sync_point(decoder, frame, GST_VIDEO_DECODER_REQUEST_SYNC_POINT_DISCARD_INPUT);
+}
+
 static GstFlowReturn gst_es_dec_handle_frame(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
     GstEsDecClass *klass = GST_ES_DEC_GET_CLASS(decoder);
     GstEsDec *self = GST_ES_DEC(decoder);
     GstMapInfo gst_map_info;
     GstBuffer *tmp = NULL;
+    gboolean imported = FALSE;
     GstFlowReturn ret;
     gint ret_send;
     MppPacketPtr mpp_pkt = NULL;
 
+    // before taking the decoder lock, a rescale or a size change on several contexts drains the decoder
+    update_caps_scale(decoder);
+    drain_for_size_change(decoder, frame);
+    if (G_UNLIKELY(self->stalled)) {
+        recover_stall(decoder, frame);
+        if (!GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT(frame)) {
+            gst_video_decoder_release_frame(decoder, frame);
+            return GST_FLOW_OK;
+        }
+    }
+
     GST_ES_DEC_LOCK(decoder);
 
     memset(&gst_map_info, 0, sizeof(GstMapInfo));
@@ -749,13 +1834,21 @@ static GstFlowReturn gst_es_dec_handle_frame(GstVideoDecoder *decoder, GstVideoC
         if (klass->set_extra_data && !klass->set_extra_data(decoder)) {
             goto err_extradata;
         }
+        self->last_output = g_get_monotonic_time();
+        start_fetch_thread(self);
         gst_pad_start_task(decoder->srcpad, (GstTaskFunction)gst_es_dec_loop, decoder, NULL);
     }
 
-    GST_VIDEO_DECODER_STREAM_UNLOCK(decoder);
-    gst_buffer_map(frame->input_buffer, &gst_map_info, GST_MAP_READ);
+    if (skip_for_trickmode(decoder, frame)) {
+        goto skip;
+    }
+    if (frame_is_late(decoder, frame)) {
+        goto qos_drop;
+    }
+    check_sequence(decoder, frame);
 
-    mpp_pkt = klass->prepare_mpp_packet(decoder, &gst_map_info);
+    GST_VIDEO_DECODER_STREAM_UNLOCK(decoder);
+    mpp_pkt = klass->prepare_mpp_packet(decoder, frame->input_buffer, &gst_map_info, &imported);
     GST_VIDEO_DECODER_STREAM_LOCK(decoder);
     if (!mpp_pkt) {
         goto err_no_packet;
@@ -765,6 +1858,8 @@ static GstFlowReturn gst_es_dec_handle_frame(GstVideoDecoder *decoder, GstVideoC
     if (GST_CLOCK_TIME_IS_VALID(frame->pts)) {
         self->found_valid_pts = TRUE;
     }
+    // index the frame before sending, the output thread may pick it up right away
+    add_pending_frame(self, frame);
     GST_TRACE_OBJECT(self,
                      "get mpp packet success, pts = %lld, found_valid_pts = %d",
                      mpp_packet_get_pts(mpp_pkt),
@@ -772,7 +1867,7 @@ static GstFlowReturn gst_es_dec_handle_frame(GstVideoDecoder *decoder, GstVideoC
 
     while (1) {
         GST_VIDEO_DECODER_STREAM_UNLOCK(decoder);
-        ret_send = klass->send_mpp_packet(decoder, mpp_pkt, IN_TIMEOUT_MS);
+        ret_send = klass->send_mpp_packet(decoder, mpp_pkt, self->in_timeout);
         if (GST_SEND_PACKET_SUCCESS == ret_send || GST_SEND_PACKET_BAD == ret_send) {
             GST_VIDEO_DECODER_STREAM_LOCK(decoder);
             break;
@@ -781,22 +1876,47 @@ static GstFlowReturn gst_es_dec_handle_frame(GstVideoDecoder *decoder, GstVideoC
         if (GST_SEND_PACKET_TIMEOUT != ret_send) {
             goto err_send;
         }
+        if (self->return_code != GST_FLOW_OK) {
+            goto err_output;
+        }
+        // the output loop polled empty after our last packet and mpp still takes no input
+        if (self->stalled || output_stalled(self, self->idle_seq == self->in_seq)) {
+            goto err_stalled;
+        }
+        GST_DEBUG_OBJECT(self, "input is full for %d ms, retry", self->in_timeout);
     }
     GST_TRACE_OBJECT(self, "packet send to mpp queue success");
+    self->sent_since_output++;
+    notify_input(decoder);
 
     mpp_pkt = NULL;
-    gst_buffer_unmap(frame->input_buffer, &gst_map_info);
-
-    tmp = frame->input_buffer;
-    frame->input_buffer = gst_buffer_new();
-    gst_buffer_copy_into(
-        frame->input_buffer, tmp, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS | GST_BUFFER_COPY_META, 0, 0);
-    gst_buffer_unref(tmp);
+    if (gst_map_info.memory) {
+        gst_buffer_unmap(frame->input_buffer, &gst_map_info);
+    }
+    // mapped and slot packets are copies by now, only an imported dma packet
+    // references the input and keeps it until the frame is done
+    if (!imported) {
+        tmp = frame->input_buffer;
+        frame->input_buffer = gst_buffer_new();
+        gst_buffer_copy_into(
+            frame->input_buffer, tmp, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS | GST_BUFFER_COPY_META, 0, 0);
+        gst_buffer_unref(tmp);
+    }
 
     gst_video_codec_frame_unref(frame);
     GST_ES_DEC_UNLOCK(decoder);
     return self->return_code;
 
+qos_drop:
+    // posts the qos message with the dropped frame counts
+    GST_DEBUG_OBJECT(self, "Drop late frame %u before decoding", frame->system_frame_number);
+    gst_video_decoder_drop_frame(decoder, frame);
+    GST_ES_DEC_UNLOCK(decoder);
+    return self->return_code;
+skip:
+    GST_DEBUG_OBJECT(self, "Skip frame %u in trick mode", frame->system_frame_number);
+    ret = GST_FLOW_OK;
+    goto drop;
 err_flushing:
     GST_WARNING_OBJECT(self, "Drop this frame bacause we are flushing");
     ret = GST_FLOW_FLUSHING;
@@ -813,18 +1933,131 @@ err_send:
     GST_WARNING_OBJECT(self, "Drop this frame because we cannot send packet");
     ret = GST_FLOW_ERROR;
     goto drop;
+err_output:
+    GST_WARNING_OBJECT(self, "Drop this frame because output stopped: %s", gst_flow_get_name(self->return_code));
+    ret = self->return_code;
+    goto drop;
+err_stalled:
+    GST_WARNING_OBJECT(self, "Drop this frame because the decoder stalled, reset on the next frame");
+    self->stalled = TRUE;
+    ret = GST_FLOW_OK;
+    goto drop;
 drop:
     if (mpp_pkt) {
         mpp_packet_deinit(&mpp_pkt);
     }
-    if (gst_map_info.size) {
+    if (gst_map_info.memory) {
         gst_buffer_unmap(frame->input_buffer, &gst_map_info);
     }
+    remove_pending_frame(self, frame->system_frame_number);
     gst_video_decoder_release_frame(decoder, frame);
     GST_ES_DEC_UNLOCK(decoder);
     return ret;
 }
 
+static gboolean gst_es_dec_propose_allocation(GstVideoDecoder *decoder, GstQuery *query) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+
+    // offer dma memory for the bitstream, so that it can be sent to mpp without copy
+    if (self->in_allocator) {
+        gst_query_add_allocation_param(query, self->in_allocator, NULL);
+    }
+
+    return GST_VIDEO_DECODER_CLASS(parent_class)->propose_allocation(decoder, query);
+}
+
+static gboolean gst_es_dec_src_event(GstVideoDecoder *decoder, GstEvent *event) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+
+    // the base class clears the pad flag when it renegotiates itself, the peer caps are checked on the next frame
+    if (GST_EVENT_TYPE(event) == GST_EVENT_RECONFIGURE) {
+        g_atomic_int_set(&self->caps_changed, TRUE);
+    }
+    return GST_VIDEO_DECODER_CLASS(parent_class)->src_event(decoder, event);
+}
+
+static gboolean gst_es_dec_decide_allocation(GstVideoDecoder *decoder, GstQuery *query) {
+    GstEsDec *self = GST_ES_DEC(decoder);
+    GstBufferPool *pool;
+    GstStructure *config;
+    GstCaps *caps = NULL;
+    guint size, min = 0, align;
+    gboolean ret = FALSE;
+
+    gst_query_parse_allocation(query, &caps, NULL);
+    if (!caps) {
+        GST_ERROR_OBJECT(self, "no caps in allocation query");
+        return FALSE;
+    }
+    // the video pool cannot parse DMA_DRM caps, configure it with the plain layout
+    if (gst_video_is_dma_drm_caps(caps)) {
+        caps = gst_video_info_to_caps(&self->gst_info);
+    } else {
+        gst_caps_ref(caps);
+    }
+
+    size = GST_VIDEO_INFO_SIZE(&self->gst_info);
+    if (gst_query_get_n_allocation_pools(query) > 0) {
+        gst_query_parse_nth_allocation_pool(query, 0, NULL, NULL, &min, NULL);
+    }
+    self->downstream_min = min;
+    GST_DEBUG_OBJECT(self, "downstream requires %u buffers", min);
+
+    // a pool offered by downstream is imported at the info change, if it holds dmabufs
+    release_ext_pool(self);
+    if (gst_query_get_n_allocation_pools(query) > 0
+        && gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL)) {
+        gst_query_parse_nth_allocation_pool(query, 0, &self->ext_pool, NULL, NULL, NULL);
+        if (self->ext_pool && !ext_pool_is_dmabuf(self->ext_pool, query)) {
+            GST_DEBUG_OBJECT(self, "downstream pool %" GST_PTR_FORMAT " does not allocate dmabufs", self->ext_pool);
+            gst_object_unref(self->ext_pool);
+            self->ext_pool = NULL;
+        }
+    }
+
+    align = gst_es_query_get_stride_align(query);
+    if (align > self->stride_align) {
+        // the current sequence keeps the stride mpp already allocated, the next one uses the coarser alignment
+        GST_INFO_OBJECT(self, "downstream requires stride align %u, was %u", align, self->stride_align);
+        self->downstream_align = align;
+        self->stride_align = align;
+        if (self->mpp_dec_cfg) {
+            mpp_dec_cfg_set_s32(self->mpp_dec_cfg, "stride_align", align);
+            if (!apply_dec_cfg(self)) {
+                GST_WARNING_OBJECT(self, "failed to set stride align %u", align);
+            }
+        }
+    }
+
+    /* Output buffers are wrappers of decoded mpp buffers. The pool is set up and
+     * advertised with no minimum, so activating it does not preallocate from the
+     * allocator group behind mpp's back; downstream_min sizes the group instead.
+     */
+    pool = gst_es_buffer_pool_new();
+    config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, caps, size, 0, 0);
+    gst_buffer_pool_config_set_allocator(config, self->allocator, NULL);
+    gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+    if (!gst_buffer_pool_set_config(pool, config)) {
+        GST_ERROR_OBJECT(self, "failed to set pool config");
+        goto out;
+    }
+
+    if (gst_query_get_n_allocation_pools(query) > 0) {
+        gst_query_set_nth_allocation_pool(query, 0, pool, size, 0, 0);
+    } else {
+        gst_query_add_allocation_pool(query, pool, size, 0, 0);
+    }
+
+    gst_object_replace((GstObject **)&self->pool, GST_OBJECT(pool));
+    ret = TRUE;
+
+out:
+    gst_object_unref(pool);
+    gst_caps_unref(caps);
+    return ret;
+}
+
 static GstStateChangeReturn gst_es_dec_change_state(GstElement *element, GstStateChange transition) {
     GstVideoDecoder *decoder = GST_VIDEO_DECODER(element);
     GstEsDec *self = GST_ES_DEC(decoder);
@@ -880,6 +2113,10 @@ static GstStateChangeReturn gst_es_dec_change_state(GstElement *element, GstStat
 static void gst_es_dec_init(GstEsDec *self) {
     GstVideoDecoder *decoder = GST_VIDEO_DECODER(self);
     gst_video_decoder_set_packetized(decoder, TRUE);
+    self->in_timeout = IN_TIMEOUT_MS;
+    self->watchdog = WATCHDOG_MS;
+    self->in_slots = IN_SLOTS;
+    self->contexts = 1;
 }
 
 static void gst_es_dec_class_init(GstEsDecClass *klass) {
@@ -896,6 +2133,9 @@ static void gst_es_dec_class_init(GstEsDecClass *klass) {
     decoder_class->finish = GST_DEBUG_FUNCPTR(gst_es_dec_finish);
     decoder_class->set_format = GST_DEBUG_FUNCPTR(gst_es_dec_set_format);
     decoder_class->handle_frame = GST_DEBUG_FUNCPTR(gst_es_dec_handle_frame);
+    decoder_class->propose_allocation = GST_DEBUG_FUNCPTR(gst_es_dec_propose_allocation);
+    decoder_class->decide_allocation = GST_DEBUG_FUNCPTR(gst_es_dec_decide_allocation);
+    decoder_class->src_event = GST_DEBUG_FUNCPTR(gst_es_dec_src_event);
     gobject_class->set_property = GST_DEBUG_FUNCPTR(gst_es_dec_set_property);
     gobject_class->get_property = GST_DEBUG_FUNCPTR(gst_es_dec_get_property);
 
@@ -990,6 +2230,78 @@ static void gst_es_dec_class_init(GstEsDecClass *klass) {
                                                      1,
                                                      0,
                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class,
+                                    PROP_IN_TIMEOUT,
+                                    g_param_spec_int("input-timeout",
+                                                     "input timeout",
+                                                     "Max milliseconds to wait for a free input slot before retrying",
+                                                     1,
+                                                     G_MAXINT,
+                                                     IN_TIMEOUT_MS,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class,
+                                    PROP_MEM_OPTIMIZE,
+                                    g_param_spec_int("mem-optimize",
+                                                     "memory optimize",
+                                                     "Allocate only the output buffers required by the stream and "
+                                                     "downstream, 0-disable, 1-enable",
+                                                     0,
+                                                     1,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class,
+                                    PROP_LOW_LATENCY,
+                                    g_param_spec_int("low-latency",
+                                                     "low latency",
+                                                     "Output frames as soon as decoded, for streams without "
+                                                     "reordering, 0-disable, 1-enable",
+                                                     0,
+                                                     1,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class,
+                                    PROP_WATCHDOG,
+                                    g_param_spec_int("watchdog",
+                                                     "watchdog",
+                                                     "Milliseconds without output while input is pending before "
+                                                     "the decoder is reset in place, 0-disable",
+                                                     0,
+                                                     G_MAXINT,
+                                                     WATCHDOG_MS,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_IN_SLOTS,
+                                    g_param_spec_int("in-slots",
+                                                     "in-slots",
+                                                     "DMA input slots small packets are copied into, "
+                                                     "0-disable",
+                                                     0,
+                                                     64,
+                                                     IN_SLOTS,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_OUTPUT_QUEUE_SIZE,
+                                    g_param_spec_int("output-queue-size",
+                                                     "output-queue-size",
+                                                     "Pictures fetched from the hardware ahead of downstream by a "
+                                                     "separate thread, 0-fetch and push on one thread",
+                                                     0,
+                                                     32,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_DROP_POLICY,
+                                    g_param_spec_int("drop-policy",
+                                                     "drop-policy",
+                                                     "When the output queue is full, 0-stop fetching "
+                                                     "1-drop the oldest picture 2-drop the newest picture",
+                                                     GST_ES_DEC_DROP_NONE,
+                                                     GST_ES_DEC_DROP_NEWEST,
+                                                     GST_ES_DEC_DROP_NONE,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
     element_class->change_state = GST_DEBUG_FUNCPTR(gst_es_dec_change_state);
 }
\ No newline at end of file
@@ -34,41 +34,101 @@ G_BEGIN_DECLS;
 typedef struct _GstEsDec GstEsDec;
 typedef struct _GstEsDecClass GstEsDecClass;
 
+#define GST_ES_DEC_EVENT_MUTEX(decoder) (&GST_ES_DEC(decoder)->event_mutex)
+#define GST_ES_DEC_EVENT_COND(decoder) (&GST_ES_DEC(decoder)->event_cond)
+
 #define GST_SEND_PACKET_SUCCESS (0)
 #define GST_SEND_PACKET_BAD (1)
 #define GST_SEND_PACKET_TIMEOUT (2)
 #define GST_SEND_PACKET_FAIL (-1)
 
+/* what the fetch thread does with a picture when the output queue is full */
+#define GST_ES_DEC_DROP_NONE (0)   /* stop fetching until downstream takes one */
+#define GST_ES_DEC_DROP_OLDEST (1) /* drop the oldest queued picture */
+#define GST_ES_DEC_DROP_NEWEST (2) /* drop the picture just fetched */
+
+#define GST_ES_DEC_MAX_CONTEXTS (8)
+#define GST_ES_DEC_IN_SLOT_SIZE (128 * 1024) /* larger packets are imported or passed by address */
+/* context i of the decoder, 0 is mpp_ctx */
+#define GST_ES_DEC_CTX(dec, i) ((i) ? (dec)->sub_ctx[(i) - 1] : (dec)->mpp_ctx)
+
 struct _GstEsDec {
     GstVideoDecoder parent;
 
     MppCodingType mpp_coding_type;
     MppCtxPtr mpp_ctx;
+    MppCtxPtr sub_ctx[GST_ES_DEC_MAX_CONTEXTS - 1]; /* more contexts for intra-only streams */
+    guint n_ctx;                                     /* contexts opened, mpp_ctx included */
+    guint in_ctx;                                    /* context the next packet goes to */
+    guint out_ctx;                                   /* context the next frame in decoding order comes from */
+    guint eos_ctx;                                   /* mask of the contexts that returned eos */
+    guint frame_ctx;                                 /* context the last polled frame came from */
     MppDecCfgPtr mpp_dec_cfg;
     MppParamPtr mpp_param;
     MppBufferGroupPtr buf_grp;
+    MppBufferGroupPtr ext_grp; /* imported downstream buffers, see import_ext_pool */
+    MppBufferGroupPtr dec_grp;  /* group the contexts decode into since the last info change */
+    GThread *prepare_thread;    /* under the stream lock, allocates ahead for the sequence announced on input */
+    gsize next_buf_size;        /* size of the buffers prepare_thread allocates */
 
     GMutex mutex;
+    GMutex event_mutex;
+    GCond event_cond;
+    guint32 in_seq;   /* bumped on input activity, wakes the output loop */
+    guint32 idle_seq; /* in_seq seen by the last empty output poll */
+    guint32 out_seq;  /* bumped on every output poll, wakes blocked input */
     GstAllocator *allocator;
+    GstAllocator *in_allocator; /* bitstream dma memory */
+    MppBufferGroupPtr in_grp;   /* recycled dma slots small packets are copied into */
+    GstBufferPool *pool;        /* output wrappers of the mpp buffers */
+    GstBufferPool *ext_pool;    /* downstream pool decoded into, NULL when mpp allocates */
     GstVideoCodecState *input_state;
     GstVideoInfo gst_info;
 
     GstVideoFormat out_format; /* config output format */
+    gboolean out_format_set;   /* output format forced by property or env, else picked from downstream caps */
     gint out_width;            /* config output width */
     gint out_height;           /* config output height */
+    gint scale_width;          /* scale width from downstream caps, when sw/sh are not set */
+    gint scale_height;         /* scale height from downstream caps, when sw/sh are not set */
+    gint caps_changed;         /* atomic, downstream sent a reconfigure event since the last scale check */
     gint extra_hw_frames;      /* config extra hardware frame buffer count*/
+    guint held_buffers;        /* output buffers the subclass keeps referenced, e.g. a decode cache */
     guint crop_x;              /* config crop x */
     guint crop_y;              /* config crop y */
     guint crop_w;              /* config crop w */
     guint crop_h;              /* config crop h */
     guint stride_align;        /* config output stride align */
+    guint downstream_align;    /* stride align announced in the downstream allocation query */
     gboolean buf_cache;        /* config the buffer cache mode */
     gboolean memset_output;    /* config if memset padding buffer */
+    gint in_timeout;           /* config max ms to wait for a free input slot */
+    gint in_slots;             /* config dma input slots for small packets, 0 disables */
+    gboolean mem_optimize;     /* config allocate only the required output buffers */
+    guint downstream_min;      /* min buffers from the downstream allocation query */
+    guint group_buf_count;     /* buffers in the group of the current sequence */
+    gint seq_width;            /* coded size of the last sps seen on input */
+    gint seq_height;
+    gboolean low_latency;      /* config output frames in decoding order */
+    gint contexts;             /* config contexts independent frames are spread over */
+    gint info_width;           /* picture size of the last info change */
+    gint info_height;
+    gint watchdog;             /* config ms without output before a stalled context is reset, 0 disables */
+    gint64 last_output;        /* monotonic time the last mpp frame was handled */
+    guint sent_since_output;   /* packets sent since the last mpp frame */
+    gboolean stalled;          /* watchdog fired, recover on the next input frame */
+    gint output_queue_size;    /* config pictures fetched ahead of downstream, 0 pushes from the fetch loop */
+    gint drop_policy;          /* config GST_ES_DEC_DROP_* when the output queue is full */
+    GThread *fetch_thread;     /* drains mpp into out_queue while the src pad task pushes */
+    gboolean fetching;         /* under event_mutex, the fetch thread keeps running */
+    GQueue out_queue;          /* under event_mutex, GstEsDecOutput fetched but not pushed */
+    guint out_queued;          /* under event_mutex, pictures held by out_queue */
 
     gboolean is_flushing;
     gboolean is_draining;
     GstFlowReturn return_code;
     guint32 frame_cnt;
+    GArray *pending_frames; /* sent frames sorted by pts, see get_gst_frame */
 
     gboolean found_valid_pts;
     GstStateChange gst_state;
@@ -77,15 +137,30 @@ struct _GstEsDec {
 struct _GstEsDecClass {
     GstVideoDecoderClass parent_class;
     gboolean (*set_extra_data)(GstVideoDecoder *decoder);
-    MppPacketPtr (*prepare_mpp_packet)(GstVideoDecoder *decoder, GstMapInfo *mapinfo);
+    /* imported is set when the packet references the input memory instead of a copy */
+    MppPacketPtr (*prepare_mpp_packet)(GstVideoDecoder *decoder,
+                                       GstBuffer *buffer,
+                                       GstMapInfo *mapinfo,
+                                       gboolean *imported);
     gint (*send_mpp_packet)(GstVideoDecoder *decoder, MppPacketPtr mpkt, gint timeout_ms);
     MppFramePtr (*get_mpp_frame)(GstVideoDecoder *decoder, gint timeout_ms);
     gboolean (*shutdown)(GstVideoDecoder *decoder, gboolean drain);
+    gboolean (*frame_is_droppable)(GstVideoDecoder *decoder, GstVideoCodecFrame *frame);
+    gboolean (*get_sequence_size)(GstVideoDecoder *decoder, GstVideoCodecFrame *frame, gint *width, gint *height);
+    void (*frame_decoded)(GstVideoDecoder *decoder, GstVideoCodecFrame *frame);
 };
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(GstEsDec, gst_object_unref);
 GType gst_es_dec_get_type(void);
 
+/* mpp buffers are plain linear dma-buf */
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR (0ULL)
+#endif
+#ifndef DRM_FORMAT_INVALID
+#define DRM_FORMAT_INVALID (0)
+#endif
+
 #define ES_DEC_FORMATS "NV12, NV21, I420, GRAY8, P010LE, BGR, RGB, BGRA, RGBA, BGRx, RGBx"
 
 G_END_DECLS;
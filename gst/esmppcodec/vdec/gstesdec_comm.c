@@ -18,7 +18,9 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <gst/allocators/gstdmabuf.h>
 #include "gstesdec_comm.h"
+#include "gstesallocator.h"
 
 struct _FmtInfo {
     GstVideoFormat fmt;
@@ -41,6 +43,19 @@ static struct _FmtInfo support_fmt_list[] = {{GST_VIDEO_FORMAT_NV12, TRUE, TRUE,
 
 static gint support_fmt_cnt = sizeof(support_fmt_list) / sizeof(support_fmt_list[0]);
 
+/* cheapest formats first, gray only when downstream accepts nothing else */
+static const GstVideoFormat auto_fmt_order[] = {GST_VIDEO_FORMAT_NV12,
+                                                GST_VIDEO_FORMAT_NV21,
+                                                GST_VIDEO_FORMAT_I420,
+                                                GST_VIDEO_FORMAT_BGR,
+                                                GST_VIDEO_FORMAT_RGB,
+                                                GST_VIDEO_FORMAT_BGRx,
+                                                GST_VIDEO_FORMAT_RGBx,
+                                                GST_VIDEO_FORMAT_BGRA,
+                                                GST_VIDEO_FORMAT_RGBA,
+                                                GST_VIDEO_FORMAT_P010_10LE,
+                                                GST_VIDEO_FORMAT_GRAY8};
+
 static gboolean check_support_by_code_type(GstVideoFormat fmt, MppCodingType mpp_coding_type) {
     for (gint i = 0; i < support_fmt_cnt; i++) {
         if (support_fmt_list[i].fmt == fmt) {
@@ -80,6 +95,7 @@ gboolean gst_es_comm_dec_set_extra_data(GstEsDec *esdec) {
     GstBuffer *codec_data = state->codec_data;
     GstMapInfo mapinfo = {0};
     MppPacketPtr mpp_packet = NULL;
+    guint i;
 
     if (!codec_data) return TRUE;
 
@@ -90,9 +106,11 @@ gboolean gst_es_comm_dec_set_extra_data(GstEsDec *esdec) {
     mpp_packet_init(&mpp_packet, mapinfo.data, mapinfo.size);
     mpp_packet_set_extra_data(mpp_packet);
 
-    if (esmpp_put_packet(esdec->mpp_ctx, mpp_packet) != MPP_OK) {
-        GST_ERROR_OBJECT(esdec, "failed to put packet");
-        return FALSE;
+    for (i = 0; i < esdec->n_ctx; i++) {
+        if (esmpp_put_packet(GST_ES_DEC_CTX(esdec, i), mpp_packet) != MPP_OK) {
+            GST_ERROR_OBJECT(esdec, "failed to put packet");
+            return FALSE;
+        }
     }
 
     mpp_packet_deinit(&mpp_packet);
@@ -102,32 +120,205 @@ gboolean gst_es_comm_dec_set_extra_data(GstEsDec *esdec) {
     return TRUE;
 }
 
+static guint32 get_out_seq(GstEsDec *esdec) {
+    guint32 out_seq;
+
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(esdec));
+    out_seq = esdec->out_seq;
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(esdec));
+    return out_seq;
+}
+
+/* Block until the output loop polled mpp again, which is when input slots get freed */
+static gboolean wait_output_progress(GstEsDec *esdec, guint32 out_seq, gint64 end_time) {
+    gboolean progress = TRUE;
+
+    g_mutex_lock(GST_ES_DEC_EVENT_MUTEX(esdec));
+    // kick the output loop in case it is sleeping after an empty poll
+    esdec->in_seq++;
+    g_cond_broadcast(GST_ES_DEC_EVENT_COND(esdec));
+    while (esdec->out_seq == out_seq) {
+        if (!g_cond_wait_until(GST_ES_DEC_EVENT_COND(esdec), GST_ES_DEC_EVENT_MUTEX(esdec), end_time)) {
+            progress = esdec->out_seq != out_seq;
+            break;
+        }
+    }
+    g_mutex_unlock(GST_ES_DEC_EVENT_MUTEX(esdec));
+    return progress;
+}
+
+static MppPacketPtr prepare_dma_packet(GstEsDec *esdec, GstBuffer *buffer) {
+    GstMemory *gst_mem, *es_mem = NULL;
+    MppBufferPtr mpp_buffer;
+    MppPacketPtr mpp_packet = NULL;
+    gsize offset, size;
+
+    if (gst_buffer_n_memory(buffer) != 1) {
+        return NULL;
+    }
+    gst_mem = gst_buffer_peek_memory(buffer, 0);
+    if (!gst_is_dmabuf_memory(gst_mem)) {
+        return NULL;
+    }
+    size = gst_memory_get_sizes(gst_mem, &offset, NULL);
+    if (offset || !size) {
+        return NULL;
+    }
+
+    mpp_buffer = get_mpp_buffer_from_gst_mem(gst_mem);
+    if (!mpp_buffer) {
+        es_mem = gst_es_allocator_import_gst_memory(esdec->in_allocator, gst_mem);
+        if (!es_mem) {
+            return NULL;
+        }
+        mpp_buffer = get_mpp_buffer_from_gst_mem(es_mem);
+    }
+
+    // the packet holds its own ref of the mpp buffer
+    if (!mpp_buffer || mpp_packet_init_with_buffer(&mpp_packet, mpp_buffer) != MPP_OK) {
+        mpp_packet = NULL;
+    } else {
+        mpp_packet_set_length(mpp_packet, size);
+    }
+
+    if (es_mem) {
+        gst_memory_unref(es_mem);
+    }
+    return mpp_packet;
+}
+
+/* Copy a small packet into a recycled dma slot. The slots cycle through mpp like a ring,
+ * a slot is free again once mpp has consumed its packet.
+ */
+static MppPacketPtr prepare_slot_packet(GstEsDec *esdec, GstBuffer *buffer) {
+    MppBufferPtr mpp_buffer = NULL;
+    MppPacketPtr mpp_packet = NULL;
+    gsize size = gst_buffer_get_size(buffer);
+    MPP_RET ret;
+
+    if (!esdec->in_slots || !size || size > GST_ES_DEC_IN_SLOT_SIZE) {
+        return NULL;
+    }
+    if (!esdec->in_grp) {
+        if (mpp_buffer_group_get_internal(&esdec->in_grp, MPP_BUFFER_TYPE_DMA_HEAP)) {
+            GST_WARNING_OBJECT(esdec, "failed to get the input slot group");
+            esdec->in_slots = 0;
+            return NULL;
+        }
+        mpp_buffer_group_limit_config(esdec->in_grp, GST_ES_DEC_IN_SLOT_SIZE, esdec->in_slots);
+    }
+
+    // every slot is still queued in mpp, passing the packet by address works as well and does not wait
+    if (mpp_buffer_group_unused(esdec->in_grp) <= 0) {
+        GST_DEBUG_OBJECT(esdec, "no free input slot, pass the packet by address");
+        return NULL;
+    }
+    mpp_buffer_get(esdec->in_grp, &mpp_buffer, GST_ES_DEC_IN_SLOT_SIZE);
+    if (!mpp_buffer) {
+        return NULL;
+    }
+    gst_buffer_extract(buffer, 0, mpp_buffer_get_ptr(mpp_buffer), size);
+
+    // the packet holds its own ref of the slot
+    ret = mpp_packet_init_with_buffer(&mpp_packet, mpp_buffer);
+    mpp_buffer_put(mpp_buffer);
+    if (ret != MPP_OK) {
+        return NULL;
+    }
+    mpp_packet_set_length(mpp_packet, size);
+    return mpp_packet;
+}
+
+MppPacketPtr gst_es_comm_dec_prepare_mpp_packet(GstEsDec *esdec,
+                                                GstBuffer *buffer,
+                                                GstMapInfo *mapinfo,
+                                                gboolean *imported) {
+    MppPacketPtr mpp_packet = NULL;
+
+    *imported = FALSE;
+    mpp_packet = prepare_dma_packet(esdec, buffer);
+    if (mpp_packet) {
+        GST_TRACE_OBJECT(esdec, "send dma buffer to mpp without copy");
+        *imported = TRUE;
+        return mpp_packet;
+    }
+    mpp_packet = prepare_slot_packet(esdec, buffer);
+    if (mpp_packet) {
+        return mpp_packet;
+    }
+
+    if (!gst_buffer_map(buffer, mapinfo, GST_MAP_READ)) {
+        GST_ERROR_OBJECT(esdec, "failed to map input buffer");
+        return NULL;
+    }
+    mpp_packet_init(&mpp_packet, mapinfo->data, mapinfo->size);
+    return mpp_packet;
+}
+
 gint gst_es_comm_dec_send_mpp_packet(GstEsDec *esdec, MppPacketPtr mpp_packet, gint timeout_ms) {
     if (!esdec || !mpp_packet) {
         GST_DEBUG_OBJECT(esdec, "params are invalid, esdec: %p, mpp_packet: %p.", esdec, mpp_packet);
         return FALSE;
     }
-    gint interval_ms = 2;
+    gint64 end_time = g_get_monotonic_time() + timeout_ms * G_TIME_SPAN_MILLISECOND;
     MPP_RET ret = MPP_OK;
-    do {
-        ret = esmpp_put_packet(esdec->mpp_ctx, mpp_packet);
+    guint32 out_seq;
+    while (1) {
+        out_seq = get_out_seq(esdec);
+        ret = esmpp_put_packet(GST_ES_DEC_CTX(esdec, esdec->in_ctx), mpp_packet);
         switch (ret) {
             case MPP_OK:
                 mpp_packet_deinit(&mpp_packet);
+                // the next packet goes to the next context
+                esdec->in_ctx = (esdec->in_ctx + 1) % esdec->n_ctx;
                 return GST_SEND_PACKET_SUCCESS;
             case MPP_ERR_STREAM:
                 mpp_packet_deinit(&mpp_packet);
                 return GST_SEND_PACKET_BAD;
             case MPP_ERR_TIMEOUT:
-                g_usleep(interval_ms * 1000);
-                timeout_ms -= interval_ms;
+                // input queue is full
+                if (!wait_output_progress(esdec, out_seq, end_time)) {
+                    return GST_SEND_PACKET_TIMEOUT;
+                }
                 break;
             default:
                 GST_ERROR_OBJECT(esdec, "put packet failed %d", ret);
                 return GST_SEND_PACKET_FAIL;
         }
-    } while (timeout_ms > 0);
-    return GST_SEND_PACKET_TIMEOUT;
+    }
+}
+
+/* Poll the contexts in the order the packets went round-robin, so that
+ * frames come out in decoding order.
+ */
+MppFramePtr gst_es_comm_dec_get_mpp_frame(GstEsDec *esdec, gint timeout_ms) {
+    MppFramePtr mpp_frame = NULL;
+    guint all = (1u << esdec->n_ctx) - 1;
+
+    while (1) {
+        // a context at eos holds no more frames
+        while (esdec->eos_ctx != all && (esdec->eos_ctx & (1u << esdec->out_ctx))) {
+            esdec->out_ctx = (esdec->out_ctx + 1) % esdec->n_ctx;
+        }
+        esdec->frame_ctx = esdec->out_ctx;
+        esmpp_get_frame(GST_ES_DEC_CTX(esdec, esdec->out_ctx), &mpp_frame, timeout_ms);
+        if (!mpp_frame || esdec->n_ctx == 1) {
+            return mpp_frame;
+        }
+        if (mpp_frame_get_eos(mpp_frame)) {
+            esdec->eos_ctx |= 1u << esdec->out_ctx;
+            if (esdec->eos_ctx == all) {
+                return mpp_frame;
+            }
+            mpp_frame_deinit(&mpp_frame);
+            continue;
+        }
+        // an info change comes ahead of the picture of the same context
+        if (!mpp_frame_get_info_change(mpp_frame)) {
+            esdec->out_ctx = (esdec->out_ctx + 1) % esdec->n_ctx;
+        }
+        return mpp_frame;
+    }
 }
 
 gboolean gst_es_comm_dec_shutdown(GstEsDec *esdec, gboolean drain) {
@@ -135,19 +326,39 @@ gboolean gst_es_comm_dec_shutdown(GstEsDec *esdec, gboolean drain) {
 
     MppPacketPtr mpp_packet;
     MPP_RET ret = 0;
+    guint32 out_seq;
+    gint64 end_time;
+    guint i;
 
     mpp_packet_init(&mpp_packet, NULL, 0);
     mpp_packet_set_eos(mpp_packet);
     GST_DEBUG_OBJECT(esdec, "shutdown, send a packet with eos flag");
 
-    while (1) {
-        ret = esmpp_put_packet(esdec->mpp_ctx, mpp_packet);
-        if (!ret) break;
-        g_usleep(1000);
+    // the output loop stops once every context returned eos
+    for (i = 0; i < esdec->n_ctx; i++) {
+        end_time = g_get_monotonic_time() + esdec->in_timeout * G_TIME_SPAN_MILLISECOND;
+        while (1) {
+            out_seq = get_out_seq(esdec);
+            ret = esmpp_put_packet(GST_ES_DEC_CTX(esdec, i), mpp_packet);
+            if (ret == MPP_OK) break;
+            if (ret != MPP_ERR_TIMEOUT) {
+                GST_ERROR_OBJECT(esdec, "put eos packet failed %d", ret);
+                goto error;
+            }
+            if (!wait_output_progress(esdec, out_seq, end_time)) {
+                GST_WARNING_OBJECT(esdec, "no output progress in %d ms while sending eos", esdec->in_timeout);
+                goto error;
+            }
+        }
     }
 
     mpp_packet_deinit(&mpp_packet);
     return TRUE;
+
+error:
+    // the caller resets the contexts without waiting for their eos
+    mpp_packet_deinit(&mpp_packet);
+    return FALSE;
 }
 
 GType get_format_type(void) {
@@ -185,6 +396,7 @@ void gst_es_comm_dec_set_default_fmt(GstEsDec *esdec, const char *fmt_env) {
             value = g_enum_get_value_by_nick(class, env);
             if (value) {
                 esdec->out_format = value->value;
+                esdec->out_format_set = TRUE;
             }
             g_type_class_unref(class);
         }
@@ -192,6 +404,65 @@ void gst_es_comm_dec_set_default_fmt(GstEsDec *esdec, const char *fmt_env) {
     GST_DEBUG_OBJECT(esdec, "Default output format is %s", gst_video_format_to_string(esdec->out_format));
 }
 
+static gboolean dma_drm_format_allowed(GstCaps *allowed, GstVideoFormat fmt) {
+    guint32 fourcc = gst_video_dma_drm_fourcc_from_format(fmt);
+    gchar *drm_format;
+    GstCaps *caps;
+    gboolean ret;
+
+    if (fourcc == DRM_FORMAT_INVALID) {
+        return FALSE;
+    }
+    drm_format = gst_video_dma_drm_fourcc_to_string(fourcc, DRM_FORMAT_MOD_LINEAR);
+    caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "DMA_DRM", "drm-format", G_TYPE_STRING, drm_format, NULL);
+    gst_caps_set_features_simple(caps, gst_caps_features_new_single(GST_CAPS_FEATURE_MEMORY_DMABUF));
+    ret = gst_caps_can_intersect(allowed, caps);
+    gst_caps_unref(caps);
+    g_free(drm_format);
+    return ret;
+}
+
+void gst_es_comm_dec_negotiate_format(GstEsDec *esdec) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(esdec);
+    GstCaps *allowed, *caps;
+    GstVideoFormat fmt;
+    gboolean found;
+    guint i;
+
+    if (esdec->out_format_set) {
+        return;
+    }
+
+    allowed = gst_pad_get_allowed_caps(decoder->srcpad);
+    if (!allowed || gst_caps_is_any(allowed)) {
+        goto out;
+    }
+    GST_DEBUG_OBJECT(esdec, "downstream allows %" GST_PTR_FORMAT, allowed);
+
+    for (i = 0; i < G_N_ELEMENTS(auto_fmt_order); i++) {
+        fmt = auto_fmt_order[i];
+        if (!check_support_by_code_type(fmt, esdec->mpp_coding_type)) {
+            continue;
+        }
+        caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, gst_video_format_to_string(fmt), NULL);
+        found = gst_caps_can_intersect(allowed, caps);
+        gst_caps_unref(caps);
+        if (!found) {
+            found = dma_drm_format_allowed(allowed, fmt);
+        }
+        if (found) {
+            esdec->out_format = fmt;
+            break;
+        }
+    }
+
+out:
+    if (allowed) {
+        gst_caps_unref(allowed);
+    }
+    GST_DEBUG_OBJECT(esdec, "Output format is %s", gst_video_format_to_string(esdec->out_format));
+}
+
 void gst_es_comm_dec_set_property(GstEsDec *self, guint prop_id, const GValue *value, GParamSpec *pspec) {
     if (!self) return;
 
@@ -205,12 +476,23 @@ void gst_es_comm_dec_set_property(GstEsDec *self, guint prop_id, const GValue *v
                     GST_WARNING_OBJECT(self, "do not support output format: %s", g_value_get_string(value));
                 } else {
                     self->out_format = format;
+                    self->out_format_set = TRUE;
                 }
-                break;
             }
-            default:
-                G_OBJECT_WARN_INVALID_PROPERTY_ID(self, prop_id, pspec);
-                break;
+            break;
+        }
+        case PROP_N_CONTEXTS: {
+            gint val = g_value_get_int(value);
+            if (self->input_state)
+                GST_WARNING_OBJECT(self, "unable to change contexts");
+            else if (val < 1 || val > GST_ES_DEC_MAX_CONTEXTS)
+                GST_WARNING_OBJECT(self, "invalid value of contexts");
+            else
+                self->contexts = val;
+            break;
         }
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(self, prop_id, pspec);
+            break;
     }
 }
@@ -29,6 +29,7 @@
 typedef enum {
     PROP_0,
     PROP_OUT_FORMAT,
+    PROP_N_CONTEXTS,
 } ES_DEC_PROP_E;
 
 GType get_format_type(void);
@@ -37,12 +38,21 @@ const gchar *gst_es_comm_dec_get_name_by_gst_video_format(const GstVideoFormat f
 
 gboolean gst_es_comm_dec_set_extra_data(GstEsDec *esdec);
 
+MppPacketPtr gst_es_comm_dec_prepare_mpp_packet(GstEsDec *esdec,
+                                                GstBuffer *buffer,
+                                                GstMapInfo *mapinfo,
+                                                gboolean *imported);
+
 gint gst_es_comm_dec_send_mpp_packet(GstEsDec *esdec, MppPacketPtr mpp_packet, gint timeout_ms);
 
+MppFramePtr gst_es_comm_dec_get_mpp_frame(GstEsDec *esdec, gint timeout_ms);
+
 gboolean gst_es_comm_dec_shutdown(GstEsDec *esdec, gboolean drain);
 
 void gst_es_comm_dec_set_default_fmt(GstEsDec *esdec, const char *fmt_env);
 
+void gst_es_comm_dec_negotiate_format(GstEsDec *esdec);
+
 void gst_es_comm_dec_set_property(GstEsDec *self, guint prop_id, const GValue *value, GParamSpec *pspec);
 
 #endif
\ No newline at end of file
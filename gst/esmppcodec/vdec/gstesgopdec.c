@@ -0,0 +1,951 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Liujie <liujie@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "gstesgopdec.h"
+#include "gstesallocator.h"
+#include "gstesdec.h"
+#include "gstesh26xparse.h"
+
+#define GST_CAT_DEFAULT es_gop_dec_debug
+GST_DEBUG_CATEGORY(GST_CAT_DEFAULT);
+
+#define DEFAULT_CONTEXTS (2)
+#define MAX_CONTEXTS (8)
+#define MAX_GOPS (64)
+#define POLL_MS (10)
+
+typedef enum {
+    PROP_0,
+    PROP_CONTEXTS,
+    PROP_MAX_GOPS,
+    PROP_OUT_FORMAT,
+} ES_GOP_DEC_PROP_E;
+
+/* input frame of a gop, in decoding order */
+typedef struct {
+    guint32 frame_number;
+    GstClockTime pts;
+    gboolean done;
+} GstEsGopFrame;
+
+/* decoded picture waiting for its gop to reach the head of the output */
+typedef struct {
+    GstBuffer *buffer;
+    GstClockTime pts;
+    gint width;
+    gint height;
+} GstEsGopOutput;
+
+typedef struct {
+    guint index;
+    MppCodingType coding;
+    GstBuffer *codec_data; /* sent as extra data ahead of the gop */
+    GstBuffer *headers;    /* parameter sets the first access unit refers to but does not carry */
+    GPtrArray *packets;    /* input buffers in decoding order */
+    GArray *frames;        /* GstEsGopFrame of the packets */
+    GQueue output;         /* GstEsGopOutput in display order */
+    gboolean done;         /* no more output, set by the worker */
+} GstEsGop;
+
+typedef struct {
+    GstEsGopDec *dec;
+    guint id;
+    GThread *thread;
+    MppCtxPtr ctx;
+    MppDecCfgPtr cfg;
+    MppCodingType coding;
+    GstAllocator *allocator; /* owns the output buffers of this context */
+} GstEsGopWorker;
+
+struct _GstEsGopDec {
+    GstVideoDecoder parent;
+
+    MppCodingType mpp_coding_type;
+    GstVideoCodecState *input_state;
+    guint nal_length_size; /* 0 for byte-stream */
+    GstVideoFormat out_format;
+    gint out_width;     /* size of the negotiated output state */
+    gint out_height;
+    gboolean video_meta; /* downstream reads strides from the video meta */
+    gint n_contexts;     /* config mpp contexts decoding in parallel */
+    gint max_gops;       /* config gops in flight, 0 for twice the contexts */
+
+    GMutex lock;
+    GCond cond;
+    GstEsGopWorker *workers;
+    guint n_workers;
+    GQueue gops;        /* dispatched gops in stream order, the head is output next */
+    GQueue todo;        /* dispatched gops no context took yet */
+    GstEsGop *cur;      /* gop collected from input */
+    GstEsH26xParamSets param_sets; /* latest parameter sets seen on input, by id */
+    guint n_gops;
+    gboolean flushing;
+    gboolean shutdown;
+};
+
+#define parent_class gst_es_gop_dec_parent_class
+G_DEFINE_TYPE(GstEsGopDec, gst_es_gop_dec, GST_TYPE_VIDEO_DECODER);
+
+static GstStaticPadTemplate gst_es_gop_dec_sink_template =
+    GST_STATIC_PAD_TEMPLATE("sink",
+                            GST_PAD_SINK,
+                            GST_PAD_ALWAYS,
+                            GST_STATIC_CAPS("video/x-h264,"
+                                            "stream-format = (string) { avc, byte-stream },"
+                                            "alignment = (string) au"
+                                            ";"
+                                            "video/x-h265,"
+                                            "stream-format = (string) { hvc1, hev1, byte-stream },"
+                                            "alignment = (string) au"
+                                            ";"));
+
+static GstStaticPadTemplate gst_es_gop_dec_src_template =
+    GST_STATIC_PAD_TEMPLATE("src",
+                            GST_PAD_SRC,
+                            GST_PAD_ALWAYS,
+                            GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{" ES_DEC_FORMATS "}") ";"));
+
+static GstEsGop *gop_new(GstEsGopDec *self, GstBuffer *headers) {
+    GstEsGop *gop = g_new0(GstEsGop, 1);
+
+    gop->index = self->n_gops++;
+    gop->coding = self->mpp_coding_type;
+    if (self->input_state->codec_data) {
+        gop->codec_data = gst_buffer_ref(self->input_state->codec_data);
+    }
+    if (headers) {
+        gop->headers = gst_buffer_ref(headers);
+    }
+    gop->packets = g_ptr_array_new_with_free_func((GDestroyNotify)gst_buffer_unref);
+    gop->frames = g_array_new(FALSE, FALSE, sizeof(GstEsGopFrame));
+    g_queue_init(&gop->output);
+    return gop;
+}
+
+static void free_output(gpointer data) {
+    GstEsGopOutput *out = data;
+    gst_buffer_unref(out->buffer);
+    g_free(out);
+}
+
+static void gop_free(GstEsGop *gop) {
+    gst_buffer_replace(&gop->codec_data, NULL);
+    gst_buffer_replace(&gop->headers, NULL);
+    g_ptr_array_unref(gop->packets);
+    g_array_free(gop->frames, TRUE);
+    g_queue_clear_full(&gop->output, free_output);
+    g_free(gop);
+}
+
+static void close_context(GstEsGopWorker *worker) {
+    if (worker->cfg) {
+        mpp_dec_cfg_deinit(&worker->cfg);
+    }
+    if (worker->ctx) {
+        esmpp_close(worker->ctx);
+        esmpp_deinit(worker->ctx);
+        esmpp_destroy(worker->ctx);
+        worker->ctx = NULL;
+    }
+    worker->coding = MPP_VIDEO_CodingUnused;
+}
+
+static gboolean open_context(GstEsGopWorker *worker, MppCodingType coding) {
+    GstEsGopDec *self = worker->dec;
+
+    if (esmpp_create(&worker->ctx, MPP_CTX_DEC, coding, 0) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to create mpp context %u", worker->id);
+        worker->ctx = NULL;
+        return FALSE;
+    }
+    if (esmpp_init(worker->ctx) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to init mpp context %u", worker->id);
+        goto error1;
+    }
+    if (mpp_dec_cfg_init(&worker->cfg) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to init mpp_dec_cfg");
+        goto error2;
+    }
+    if (esmpp_control(worker->ctx, MPP_DEC_GET_CFG, worker->cfg) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to get dec cfg");
+        goto error3;
+    }
+    mpp_dec_cfg_set_s32(worker->cfg, "output_fmt", gst_es_gst_format_to_mpp_format(self->out_format));
+    if (esmpp_control(worker->ctx, MPP_DEC_SET_CFG, worker->cfg) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to set dec cfg");
+        goto error3;
+    }
+    if (esmpp_open(worker->ctx) != MPP_OK) {
+        GST_ERROR_OBJECT(self, "failed to open mpp context %u", worker->id);
+        goto error3;
+    }
+    worker->coding = coding;
+    return TRUE;
+
+error3:
+    mpp_dec_cfg_deinit(&worker->cfg);
+error2:
+    esmpp_deinit(worker->ctx);
+error1:
+    esmpp_destroy(worker->ctx);
+    worker->ctx = NULL;
+    return FALSE;
+}
+
+static gboolean put_extra_data(GstEsGopWorker *worker, GstBuffer *codec_data) {
+    MppPacketPtr mpkt = NULL;
+    GstMapInfo mapinfo;
+    gboolean ret;
+
+    if (!gst_buffer_map(codec_data, &mapinfo, GST_MAP_READ)) {
+        return FALSE;
+    }
+    mpp_packet_init(&mpkt, mapinfo.data, mapinfo.size);
+    mpp_packet_set_extra_data(mpkt);
+    ret = esmpp_put_packet(worker->ctx, mpkt) == MPP_OK;
+    mpp_packet_deinit(&mpkt);
+    gst_buffer_unmap(codec_data, &mapinfo);
+    return ret;
+}
+
+/* wrap a decoded picture without copy, the buffer goes back to the context group on release */
+static void add_output(GstEsGopWorker *worker, GstEsGop *gop, MppFramePtr mpp_frame) {
+    GstEsGopDec *self = worker->dec;
+    MppBufferPtr mpp_buffer;
+    GstEsGopOutput *out;
+    GstBuffer *buffer;
+    GstMemory *mem;
+    GstVideoInfo info;
+    gint width = mpp_frame_get_width(mpp_frame);
+    gint height = mpp_frame_get_height(mpp_frame);
+
+    if (mpp_frame_get_info_change(mpp_frame)) {
+        GST_DEBUG_OBJECT(self, "context %u info change %dx%d", worker->id, width, height);
+        esmpp_control(worker->ctx, MPP_DEC_SET_EXT_BUF_GROUP, gst_es_allocator_get_mpp_group(worker->allocator));
+        esmpp_control(worker->ctx, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
+        return;
+    }
+    // frames without a picture are released when the gop is done
+    if (mpp_frame_get_discard(mpp_frame) || mpp_frame_get_errinfo(mpp_frame)) {
+        GST_WARNING_OBJECT(self, "context %u dropped a broken picture of gop %u", worker->id, gop->index);
+        return;
+    }
+    mpp_buffer = mpp_frame_get_buffer(mpp_frame);
+    if (!mpp_buffer) {
+        return;
+    }
+
+    gst_video_info_set_format(&info, self->out_format, width, height);
+    if (!gst_es_video_info_align(
+            &info, mpp_frame_get_hor_stride(mpp_frame), mpp_frame_get_ver_stride(mpp_frame), 0)) {
+        return;
+    }
+    mpp_buffer_set_index(mpp_buffer, gst_es_allocator_get_index(worker->allocator));
+    mem = gst_es_allocator_import_mppbuf(worker->allocator, mpp_buffer);
+    if (!mem) {
+        return;
+    }
+    buffer = gst_buffer_new();
+    gst_buffer_append_memory(buffer, mem);
+    gst_buffer_resize(buffer, 0, GST_VIDEO_INFO_SIZE(&info));
+    gst_buffer_add_video_meta_full(buffer,
+                                   GST_VIDEO_FRAME_FLAG_NONE,
+                                   GST_VIDEO_INFO_FORMAT(&info),
+                                   width,
+                                   height,
+                                   GST_VIDEO_INFO_N_PLANES(&info),
+                                   info.offset,
+                                   info.stride);
+
+    out = g_new0(GstEsGopOutput, 1);
+    out->buffer = buffer;
+    out->pts = (GstClockTime)mpp_frame_get_pts(mpp_frame);
+    out->width = width;
+    out->height = height;
+
+    g_mutex_lock(&self->lock);
+    g_queue_push_tail(&gop->output, out);
+    g_cond_broadcast(&self->cond);
+    g_mutex_unlock(&self->lock);
+}
+
+static MppPacketPtr next_packet(GstEsGop *gop, guint index, GstBuffer **buffer, GstMapInfo *mapinfo) {
+    MppPacketPtr mpkt = NULL;
+
+    if (index == gop->packets->len) {
+        mpp_packet_init(&mpkt, NULL, 0);
+        mpp_packet_set_eos(mpkt);
+        return mpkt;
+    }
+    if (!index && gop->headers) {
+        // the first access unit lacks the parameter sets of a byte-stream cut
+        *buffer = gst_buffer_append(gst_buffer_ref(gop->headers), gst_buffer_ref(g_ptr_array_index(gop->packets, 0)));
+    } else {
+        *buffer = gst_buffer_ref(g_ptr_array_index(gop->packets, index));
+    }
+    if (!gst_buffer_map(*buffer, mapinfo, GST_MAP_READ)) {
+        gst_buffer_replace(buffer, NULL);
+        return NULL;
+    }
+    mpp_packet_init(&mpkt, mapinfo->data, mapinfo->size);
+    mpp_packet_set_pts(mpkt, (ES_S64)g_array_index(gop->frames, GstEsGopFrame, index).pts);
+    return mpkt;
+}
+
+static void release_packet(MppPacketPtr *mpkt, GstBuffer **buffer, GstMapInfo *mapinfo) {
+    mpp_packet_deinit(mpkt);
+    *mpkt = NULL;
+    if (*buffer) {
+        gst_buffer_unmap(*buffer, mapinfo);
+        gst_buffer_replace(buffer, NULL);
+    }
+}
+
+/* Decode a whole gop from a clean context, feeding input while collecting output */
+static gboolean decode_gop(GstEsGopWorker *worker, GstEsGop *gop) {
+    GstEsGopDec *self = worker->dec;
+    MppPacketPtr mpkt = NULL;
+    MppFramePtr mpp_frame;
+    GstBuffer *buffer = NULL;
+    GstMapInfo mapinfo;
+    guint next = 0;
+    gboolean eos_sent = FALSE;
+    gboolean eos = FALSE;
+    gboolean ret = TRUE;
+    MPP_RET put_ret;
+
+    if (worker->coding != gop->coding) {
+        close_context(worker);
+        if (!open_context(worker, gop->coding)) {
+            GST_ELEMENT_ERROR(self, LIBRARY, INIT, ("Failed to open mpp context %u", worker->id), (NULL));
+            return FALSE;
+        }
+    }
+    if (gop->codec_data && !put_extra_data(worker, gop->codec_data)) {
+        GST_WARNING_OBJECT(self, "context %u failed to take codec data", worker->id);
+        return FALSE;
+    }
+
+    while (!eos) {
+        if (g_atomic_int_get(&self->flushing)) {
+            ret = FALSE;
+            break;
+        }
+        if (!mpkt && !eos_sent) {
+            mpkt = next_packet(gop, next, &buffer, &mapinfo);
+            if (!mpkt) {
+                ret = FALSE;
+                break;
+            }
+        }
+        if (mpkt) {
+            put_ret = esmpp_put_packet(worker->ctx, mpkt);
+            if (put_ret == MPP_OK || put_ret == MPP_ERR_STREAM) {
+                release_packet(&mpkt, &buffer, &mapinfo);
+                eos_sent = next++ == gop->packets->len;
+            } else if (put_ret != MPP_ERR_TIMEOUT) {
+                GST_WARNING_OBJECT(self, "context %u put packet failed %d", worker->id, put_ret);
+                ret = FALSE;
+                break;
+            }
+        }
+
+        // only block once the input is full or all of it is sent
+        mpp_frame = NULL;
+        esmpp_get_frame(worker->ctx, &mpp_frame, mpkt || eos_sent ? POLL_MS : 0);
+        if (mpp_frame) {
+            eos = mpp_frame_get_eos(mpp_frame);
+            if (!eos) {
+                add_output(worker, gop, mpp_frame);
+            }
+            mpp_frame_deinit(&mpp_frame);
+        }
+    }
+
+    if (mpkt) {
+        release_packet(&mpkt, &buffer, &mapinfo);
+    }
+    // ready for the next gop, which starts with a key frame
+    esmpp_reset(worker->ctx);
+    return ret;
+}
+
+static gpointer worker_thread(gpointer data) {
+    GstEsGopWorker *worker = data;
+    GstEsGopDec *self = worker->dec;
+    GstEsGop *gop;
+
+    g_mutex_lock(&self->lock);
+    while (1) {
+        while (!self->shutdown && g_queue_is_empty(&self->todo)) {
+            g_cond_wait(&self->cond, &self->lock);
+        }
+        if (self->shutdown) {
+            break;
+        }
+        gop = g_queue_pop_head(&self->todo);
+        g_mutex_unlock(&self->lock);
+
+        GST_DEBUG_OBJECT(self, "context %u decodes gop %u of %u frames", worker->id, gop->index, gop->packets->len);
+        if (!decode_gop(worker, gop)) {
+            GST_WARNING_OBJECT(self, "context %u failed to decode gop %u", worker->id, gop->index);
+        }
+
+        g_mutex_lock(&self->lock);
+        gop->done = TRUE;
+        g_cond_broadcast(&self->cond);
+    }
+    g_mutex_unlock(&self->lock);
+
+    close_context(worker);
+    return NULL;
+}
+
+static void stop_workers(GstEsGopDec *self) {
+    guint i;
+
+    g_mutex_lock(&self->lock);
+    self->shutdown = TRUE;
+    g_cond_broadcast(&self->cond);
+    g_mutex_unlock(&self->lock);
+
+    for (i = 0; i < self->n_workers; i++) {
+        if (self->workers[i].thread) {
+            g_thread_join(self->workers[i].thread);
+        }
+        if (self->workers[i].allocator) {
+            gst_object_unref(self->workers[i].allocator);
+        }
+    }
+    g_free(self->workers);
+    self->workers = NULL;
+    self->n_workers = 0;
+}
+
+static gboolean start_workers(GstEsGopDec *self) {
+    GstEsGopWorker *worker;
+    gchar name[16];
+    guint i;
+
+    self->shutdown = FALSE;
+    self->workers = g_new0(GstEsGopWorker, self->n_contexts);
+    for (i = 0; i < (guint)self->n_contexts; i++) {
+        worker = &self->workers[i];
+        worker->dec = self;
+        worker->id = i;
+        worker->coding = MPP_VIDEO_CodingUnused;
+        worker->allocator = gst_es_allocator_new(FALSE);
+        if (!worker->allocator) {
+            GST_ERROR_OBJECT(self, "failed to create allocator of context %u", i);
+            break;
+        }
+        g_snprintf(name, sizeof(name), "esgopdec-%u", i);
+        worker->thread = g_thread_new(name, worker_thread, worker);
+        self->n_workers++;
+    }
+    if (self->n_workers < (guint)self->n_contexts) {
+        stop_workers(self);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Drop every gop in flight, the contexts stop decoding at the next poll */
+static void discard_gops(GstEsGopDec *self) {
+    GstEsGop *gop;
+
+    g_mutex_lock(&self->lock);
+    g_atomic_int_set(&self->flushing, TRUE);
+    while ((gop = g_queue_pop_head(&self->todo))) {
+        gop->done = TRUE;
+    }
+    while ((gop = g_queue_peek_head(&self->gops))) {
+        if (!gop->done) {
+            g_cond_wait(&self->cond, &self->lock);
+            continue;
+        }
+        g_queue_pop_head(&self->gops);
+        gop_free(gop);
+    }
+    g_atomic_int_set(&self->flushing, FALSE);
+    g_mutex_unlock(&self->lock);
+
+    if (self->cur) {
+        gop_free(self->cur);
+        self->cur = NULL;
+    }
+}
+
+static GstEsGopFrame *match_frame(GstEsGop *gop, GstClockTime pts) {
+    GstEsGopFrame *entry, *first = NULL;
+    guint i;
+
+    for (i = 0; i < gop->frames->len; i++) {
+        entry = &g_array_index(gop->frames, GstEsGopFrame, i);
+        if (entry->done) {
+            continue;
+        }
+        if (GST_CLOCK_TIME_IS_VALID(pts) && entry->pts == pts) {
+            return entry;
+        }
+        if (!first) {
+            first = entry;
+        }
+    }
+    // without timestamps the pictures can only be taken in order
+    return GST_CLOCK_TIME_IS_VALID(pts) ? NULL : first;
+}
+
+static gboolean update_output_state(GstEsGopDec *self, gint width, gint height) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(self);
+    GstVideoCodecState *output_state;
+
+    if (width == self->out_width && height == self->out_height) {
+        return TRUE;
+    }
+    GST_DEBUG_OBJECT(self, "output size %dx%d, was %dx%d", width, height, self->out_width, self->out_height);
+    output_state = gst_video_decoder_set_output_state(decoder, self->out_format, width, height, self->input_state);
+    gst_video_codec_state_unref(output_state);
+    if (!gst_video_decoder_negotiate(decoder)) {
+        return FALSE;
+    }
+    self->out_width = width;
+    self->out_height = height;
+    return TRUE;
+}
+
+/* copy into a buffer of the downstream layout, for peers that ignore the video meta */
+static GstBuffer *copy_output(GstEsGopDec *self, GstBuffer *buffer) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(self);
+    GstVideoCodecState *output_state = gst_video_decoder_get_output_state(decoder);
+    GstVideoFrame src, dst;
+    GstBuffer *copy;
+
+    copy = gst_video_decoder_allocate_output_buffer(decoder);
+    if (!copy) {
+        gst_video_codec_state_unref(output_state);
+        return NULL;
+    }
+    if (!gst_video_frame_map(&src, &output_state->info, buffer, GST_MAP_READ)) {
+        goto error;
+    }
+    if (!gst_video_frame_map(&dst, &output_state->info, copy, GST_MAP_WRITE)) {
+        gst_video_frame_unmap(&src);
+        goto error;
+    }
+    gst_video_frame_copy(&dst, &src);
+    gst_video_frame_unmap(&dst);
+    gst_video_frame_unmap(&src);
+    gst_video_codec_state_unref(output_state);
+    return copy;
+
+error:
+    gst_buffer_unref(copy);
+    gst_video_codec_state_unref(output_state);
+    return NULL;
+}
+
+static GstFlowReturn finish_output(GstEsGopDec *self, GstEsGop *gop, GstEsGopOutput *out) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(self);
+    GstVideoCodecFrame *frame = NULL;
+    GstEsGopFrame *entry;
+    GstBuffer *buffer;
+
+    entry = match_frame(gop, out->pts);
+    if (entry) {
+        entry->done = TRUE;
+        frame = gst_video_decoder_get_frame(decoder, entry->frame_number);
+    }
+    if (!frame) {
+        GST_WARNING_OBJECT(self, "no frame for picture pts %" GST_TIME_FORMAT, GST_TIME_ARGS(out->pts));
+        free_output(out);
+        return GST_FLOW_OK;
+    }
+    if (!update_output_state(self, out->width, out->height)) {
+        free_output(out);
+        gst_video_decoder_release_frame(decoder, frame);
+        return GST_FLOW_NOT_NEGOTIATED;
+    }
+
+    buffer = self->video_meta ? gst_buffer_ref(out->buffer) : copy_output(self, out->buffer);
+    free_output(out);
+    if (!buffer) {
+        gst_video_decoder_release_frame(decoder, frame);
+        return GST_FLOW_ERROR;
+    }
+    frame->output_buffer = buffer;
+    return gst_video_decoder_finish_frame(decoder, frame);
+}
+
+/* frames of a done gop that produced no picture */
+static void release_missing(GstEsGopDec *self, GstEsGop *gop) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(self);
+    GstVideoCodecFrame *frame;
+    GstEsGopFrame *entry;
+    guint i;
+
+    for (i = 0; i < gop->frames->len; i++) {
+        entry = &g_array_index(gop->frames, GstEsGopFrame, i);
+        if (entry->done) {
+            continue;
+        }
+        frame = gst_video_decoder_get_frame(decoder, entry->frame_number);
+        if (frame) {
+            GST_DEBUG_OBJECT(self, "no picture for frame %u of gop %u", entry->frame_number, gop->index);
+            gst_video_decoder_release_frame(decoder, frame);
+        }
+    }
+}
+
+/* Push the pictures of the head gops in stream order, waits while more than
+ * max_in_flight gops are dispatched. Called with the stream lock.
+ */
+static GstFlowReturn push_ready(GstEsGopDec *self, guint max_in_flight) {
+    GstFlowReturn ret = GST_FLOW_OK;
+    GstEsGopOutput *out;
+    GstEsGop *gop;
+
+    g_mutex_lock(&self->lock);
+    while ((gop = g_queue_peek_head(&self->gops))) {
+        out = g_queue_pop_head(&gop->output);
+        if (out) {
+            g_mutex_unlock(&self->lock);
+            ret = finish_output(self, gop, out);
+            g_mutex_lock(&self->lock);
+            if (ret != GST_FLOW_OK) {
+                break;
+            }
+            continue;
+        }
+        if (gop->done) {
+            g_queue_pop_head(&self->gops);
+            g_mutex_unlock(&self->lock);
+            release_missing(self, gop);
+            gop_free(gop);
+            g_mutex_lock(&self->lock);
+            continue;
+        }
+        if (g_queue_get_length(&self->gops) <= max_in_flight) {
+            break;
+        }
+        g_cond_wait(&self->cond, &self->lock);
+    }
+    g_mutex_unlock(&self->lock);
+    return ret;
+}
+
+static guint get_max_gops(GstEsGopDec *self) {
+    return self->max_gops ? (guint)self->max_gops : 2 * self->n_workers;
+}
+
+static GstFlowReturn dispatch_gop(GstEsGopDec *self) {
+    GstFlowReturn ret;
+
+    // bound the decoded pictures held in memory
+    ret = push_ready(self, get_max_gops(self) - 1);
+    if (ret != GST_FLOW_OK) {
+        return ret;
+    }
+
+    g_mutex_lock(&self->lock);
+    g_queue_push_tail(&self->gops, self->cur);
+    g_queue_push_tail(&self->todo, self->cur);
+    g_cond_broadcast(&self->cond);
+    g_mutex_unlock(&self->lock);
+    self->cur = NULL;
+    return GST_FLOW_OK;
+}
+
+static gboolean gst_es_gop_dec_start(GstVideoDecoder *decoder) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+
+    GST_DEBUG_OBJECT(self, "starting %d contexts", self->n_contexts);
+    self->mpp_coding_type = MPP_VIDEO_CodingUnused;
+    self->input_state = NULL;
+    self->out_width = 0;
+    self->out_height = 0;
+    self->video_meta = FALSE;
+    self->cur = NULL;
+    memset(&self->param_sets, 0, sizeof(GstEsH26xParamSets));
+    self->n_gops = 0;
+    self->flushing = FALSE;
+    g_queue_init(&self->gops);
+    g_queue_init(&self->todo);
+    return start_workers(self);
+}
+
+static gboolean gst_es_gop_dec_stop(GstVideoDecoder *decoder) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+
+    GST_DEBUG_OBJECT(self, "stopping");
+    discard_gops(self);
+    stop_workers(self);
+    gst_es_h26x_param_sets_clear(&self->param_sets);
+    if (self->input_state) {
+        gst_video_codec_state_unref(self->input_state);
+        self->input_state = NULL;
+    }
+    return TRUE;
+}
+
+static gboolean gst_es_gop_dec_flush(GstVideoDecoder *decoder) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+
+    GST_DEBUG_OBJECT(self, "flushing");
+    discard_gops(self);
+    return TRUE;
+}
+
+static GstFlowReturn gst_es_gop_dec_finish(GstVideoDecoder *decoder) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+    GstFlowReturn ret;
+
+    GST_DEBUG_OBJECT(self, "draining %u gops", g_queue_get_length(&self->gops) + !!self->cur);
+    if (self->cur) {
+        ret = dispatch_gop(self);
+        if (ret != GST_FLOW_OK) {
+            return ret;
+        }
+    }
+    return push_ready(self, 0);
+}
+
+static gboolean gst_es_gop_dec_set_format(GstVideoDecoder *decoder, GstVideoCodecState *state) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+    GstStructure *structure = gst_caps_get_structure(state->caps, 0);
+
+    if (gst_structure_has_name(structure, "video/x-h264")) {
+        self->mpp_coding_type = MPP_VIDEO_CodingAVC;
+    } else if (gst_structure_has_name(structure, "video/x-h265")) {
+        self->mpp_coding_type = MPP_VIDEO_CodingHEVC;
+    } else {
+        GST_ERROR_OBJECT(self, "esgopdec only support AVC and HEVC");
+        return FALSE;
+    }
+    self->nal_length_size =
+        gst_es_h26x_get_nal_length_size(gst_structure_get_string(structure, "stream-format"), state->codec_data);
+
+    // gops cut so far keep the codec data they were cut with
+    if (self->input_state) {
+        gst_video_codec_state_unref(self->input_state);
+    }
+    self->input_state = gst_video_codec_state_ref(state);
+    return TRUE;
+}
+
+static GstFlowReturn gst_es_gop_dec_handle_frame(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+    gboolean is_hevc = self->mpp_coding_type == MPP_VIDEO_CodingHEVC;
+    GstBuffer *headers = NULL;
+    GstEsGopFrame entry;
+    GstMapInfo mapinfo;
+    GstFlowReturn ret;
+    gboolean idr;
+
+    if (!gst_buffer_map(frame->input_buffer, &mapinfo, GST_MAP_READ)) {
+        gst_video_decoder_release_frame(decoder, frame);
+        return GST_FLOW_ERROR;
+    }
+    idr = gst_es_h26x_is_idr(mapinfo.data, mapinfo.size, self->nal_length_size, is_hevc);
+    if (idr) {
+        // a fresh context needs every set the gop refers to, the idr may repeat only some of them
+        headers = gst_es_h26x_param_sets_missing(
+            &self->param_sets, mapinfo.data, mapinfo.size, self->nal_length_size, is_hevc);
+    }
+    gst_es_h26x_param_sets_update(&self->param_sets, mapinfo.data, mapinfo.size, self->nal_length_size, is_hevc);
+    gst_buffer_unmap(frame->input_buffer, &mapinfo);
+
+    // gops are only independent when they start with an idr picture
+    if (idr) {
+        if (self->cur) {
+            ret = dispatch_gop(self);
+            if (ret != GST_FLOW_OK) {
+                gst_buffer_replace(&headers, NULL);
+                gst_video_decoder_release_frame(decoder, frame);
+                return ret;
+            }
+        }
+        self->cur = gop_new(self, headers);
+        gst_buffer_replace(&headers, NULL);
+    }
+    if (!self->cur) {
+        GST_DEBUG_OBJECT(self, "drop frame %u before the first idr", frame->system_frame_number);
+        gst_video_decoder_release_frame(decoder, frame);
+        return push_ready(self, G_MAXUINT);
+    }
+
+    g_ptr_array_add(self->cur->packets, gst_buffer_ref(frame->input_buffer));
+    entry.frame_number = frame->system_frame_number;
+    entry.pts = frame->pts;
+    entry.done = FALSE;
+    g_array_append_val(self->cur->frames, entry);
+    gst_video_codec_frame_unref(frame);
+
+    // forward what got decoded meanwhile without waiting
+    return push_ready(self, G_MAXUINT);
+}
+
+static gboolean gst_es_gop_dec_decide_allocation(GstVideoDecoder *decoder, GstQuery *query) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(decoder);
+
+    // the decoded pictures keep the stride of mpp, else they are copied
+    self->video_meta = gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+    return GST_VIDEO_DECODER_CLASS(parent_class)->decide_allocation(decoder, query);
+}
+
+static void gst_es_gop_dec_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(object);
+
+    switch (prop_id) {
+        case PROP_CONTEXTS: {
+            if (self->workers)
+                GST_WARNING_OBJECT(self, "unable to change contexts while running");
+            else
+                self->n_contexts = g_value_get_int(value);
+            break;
+        }
+        case PROP_MAX_GOPS: {
+            gint max_gops = g_value_get_int(value);
+            if (max_gops && max_gops < self->n_contexts)
+                GST_WARNING_OBJECT(self, "max-gops %d leaves contexts idle", max_gops);
+            self->max_gops = max_gops;
+            break;
+        }
+        case PROP_OUT_FORMAT: {
+            GstVideoFormat format = gst_video_format_from_string(g_value_get_string(value));
+            if (self->workers)
+                GST_WARNING_OBJECT(self, "unable to change output format");
+            else if (gst_es_gst_format_to_mpp_format(format) == MPP_FMT_BUTT)
+                GST_WARNING_OBJECT(self, "do not support output format: %s", g_value_get_string(value));
+            else
+                self->out_format = format;
+            break;
+        }
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+static void gst_es_gop_dec_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(object);
+
+    switch (prop_id) {
+        case PROP_CONTEXTS:
+            g_value_set_int(value, self->n_contexts);
+            break;
+        case PROP_MAX_GOPS:
+            g_value_set_int(value, self->max_gops);
+            break;
+        case PROP_OUT_FORMAT:
+            g_value_set_string(value, gst_video_format_to_string(self->out_format));
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+}
+
+static void gst_es_gop_dec_finalize(GObject *object) {
+    GstEsGopDec *self = GST_ES_GOP_DEC(object);
+
+    g_mutex_clear(&self->lock);
+    g_cond_clear(&self->cond);
+    G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+static void gst_es_gop_dec_init(GstEsGopDec *self) {
+    GstVideoDecoder *decoder = GST_VIDEO_DECODER(self);
+
+    gst_video_decoder_set_packetized(decoder, TRUE);
+    self->n_contexts = DEFAULT_CONTEXTS;
+    self->out_format = GST_VIDEO_FORMAT_NV12;
+    g_mutex_init(&self->lock);
+    g_cond_init(&self->cond);
+}
+
+static void gst_es_gop_dec_class_init(GstEsGopDecClass *klass) {
+    GstVideoDecoderClass *decoder_class = GST_VIDEO_DECODER_CLASS(klass);
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+
+    GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "esgopdec", 0, "ESWIN gop parallel decoder");
+
+    decoder_class->start = GST_DEBUG_FUNCPTR(gst_es_gop_dec_start);
+    decoder_class->stop = GST_DEBUG_FUNCPTR(gst_es_gop_dec_stop);
+    decoder_class->flush = GST_DEBUG_FUNCPTR(gst_es_gop_dec_flush);
+    decoder_class->drain = GST_DEBUG_FUNCPTR(gst_es_gop_dec_finish);
+    decoder_class->finish = GST_DEBUG_FUNCPTR(gst_es_gop_dec_finish);
+    decoder_class->set_format = GST_DEBUG_FUNCPTR(gst_es_gop_dec_set_format);
+    decoder_class->handle_frame = GST_DEBUG_FUNCPTR(gst_es_gop_dec_handle_frame);
+    decoder_class->decide_allocation = GST_DEBUG_FUNCPTR(gst_es_gop_dec_decide_allocation);
+
+    gobject_class->set_property = GST_DEBUG_FUNCPTR(gst_es_gop_dec_set_property);
+    gobject_class->get_property = GST_DEBUG_FUNCPTR(gst_es_gop_dec_get_property);
+    gobject_class->finalize = GST_DEBUG_FUNCPTR(gst_es_gop_dec_finalize);
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_CONTEXTS,
+                                    g_param_spec_int("contexts",
+                                                     "contexts",
+                                                     "Number of mpp contexts decoding gops in parallel",
+                                                     1,
+                                                     MAX_CONTEXTS,
+                                                     DEFAULT_CONTEXTS,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_MAX_GOPS,
+                                    g_param_spec_int("max-gops",
+                                                     "max-gops",
+                                                     "Max gops decoded ahead of the output, bounds the memory held "
+                                                     "by decoded pictures, 0-twice the contexts",
+                                                     0,
+                                                     MAX_GOPS,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_OUT_FORMAT,
+                                    g_param_spec_string("format",
+                                                        "Set the output format",
+                                                        "NV12 NV21 I420 GRAY8 BGR RGB BGRA RGBA BGRx RGBx P010_10LE",
+                                                        "NV12",
+                                                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_add_static_pad_template(element_class, &gst_es_gop_dec_src_template);
+    gst_element_class_add_static_pad_template(element_class, &gst_es_gop_dec_sink_template);
+
+    gst_element_class_set_static_metadata(element_class,
+                                          "ESWIN gop parallel video decoder",
+                                          "Codec/Decoder/Video",
+                                          "Offline (HEVC / AVC) hardware decoder splitting the stream at idr "
+                                          "pictures over several contexts",
+                                          "Liujie <liujie@eswincomputing.com>");
+}
+
+gboolean gst_es_gop_dec_register(GstPlugin *plugin, guint rank) {
+    return gst_element_register(plugin, "esgopdec", rank, GST_TYPE_ES_GOP_DEC);
+}
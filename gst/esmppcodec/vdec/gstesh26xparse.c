@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Liujie <liujie@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "gstesh26xparse.h"
+
+#define H264_NAL_SLICE (1)
+#define H264_NAL_SLICE_IDR (5)
+#define H264_NAL_SEI (6)
+#define H264_NAL_SPS (7)
+#define H264_NAL_PPS (8)
+#define H264_NAL_AUD (9)
+#define H264_NAL_PREFIX (14)
+#define H264_NAL_RSV18 (18)
+#define H265_NAL_RSV_VCL_N14 (14)
+#define H265_NAL_BLA_W_LP (16)
+#define H265_NAL_IDR_W_RADL (19)
+#define H265_NAL_IDR_N_LP (20)
+#define H265_NAL_RSV_IRAP23 (23)
+#define H265_NAL_RSV_VCL31 (31)
+#define H265_NAL_VPS (32)
+#define H265_NAL_SPS (33)
+#define H265_NAL_PPS (34)
+#define H265_NAL_AUD (35)
+#define H265_NAL_PREFIX_SEI (39)
+#define H265_NAL_RSV41 (41)
+#define H265_NAL_RSV44 (44)
+#define H265_NAL_UNSPEC48 (48)
+#define H265_NAL_UNSPEC55 (55)
+
+/* non zero if any byte of the 64 bit word is zero */
+#define HAS_ZERO_BYTE(w) (((w) - 0x0101010101010101ULL) & ~(w) & 0x8080808080808080ULL)
+
+/* msb first bit reader over a nal payload, skipping emulation prevention bytes */
+typedef struct {
+    const guint8 *data;
+    gsize size;
+    gsize pos;
+    guint bit;
+    guint zeros;
+    gboolean error;
+} GstEsBitReader;
+
+guint gst_es_h26x_get_nal_length_size(const gchar *stream_format, GstBuffer *codec_data) {
+    GstMapInfo mapinfo;
+    guint nal_length_size = 4;
+
+    if (!g_strcmp0(stream_format, "byte-stream") || (!stream_format && !codec_data)) {
+        return 0;
+    }
+    if (!codec_data || !gst_buffer_map(codec_data, &mapinfo, GST_MAP_READ)) {
+        return nal_length_size;
+    }
+
+    // lengthSizeMinusOne of the avcC/hvcC record
+    if (mapinfo.size && mapinfo.data[0] == 1) {
+        if (g_str_has_prefix(stream_format ? stream_format : "avc", "avc")) {
+            if (mapinfo.size >= 7) nal_length_size = (mapinfo.data[4] & 0x3) + 1;
+        } else {
+            if (mapinfo.size >= 23) nal_length_size = (mapinfo.data[21] & 0x3) + 1;
+        }
+    }
+    gst_buffer_unmap(codec_data, &mapinfo);
+    return nal_length_size;
+}
+
+/* highest hevc temporal id from numTemporalLayers of the hvcC record, FALSE if unknown */
+gboolean gst_es_h26x_get_hvcc_max_tid(GstBuffer *codec_data, gint *max_tid) {
+    GstMapInfo mapinfo;
+    guint layers = 0;
+
+    if (!codec_data || !gst_buffer_map(codec_data, &mapinfo, GST_MAP_READ)) {
+        return FALSE;
+    }
+    if (mapinfo.size >= 23 && mapinfo.data[0] == 1) {
+        layers = (mapinfo.data[21] >> 3) & 0x7;
+    }
+    gst_buffer_unmap(codec_data, &mapinfo);
+    if (!layers) return FALSE;
+    *max_tid = layers - 1;
+    return TRUE;
+}
+
+gssize gst_es_h26x_find_start_code(const guint8 *data, gsize size, gsize offset) {
+    guint64 word;
+
+    while (offset + 3 <= size) {
+        // a start code begins with a zero byte, skip whole words without one
+        if (offset + 8 <= size) {
+            memcpy(&word, data + offset, 8);
+            if (!HAS_ZERO_BYTE(word)) {
+                offset += 8;
+                continue;
+            }
+        }
+        // no start code can begin in this window, skip it at once
+        if (data[offset + 2] > 1) {
+            offset += 3;
+        } else if (!data[offset] && !data[offset + 1] && data[offset + 2] == 1) {
+            return offset;
+        } else {
+            offset++;
+        }
+    }
+    return -1;
+}
+
+gboolean gst_es_h26x_next_nal(
+    const guint8 *data, gsize size, guint nal_length_size, gsize *offset, const guint8 **nal, gsize *nal_size) {
+    gssize start, end;
+    gsize len = 0;
+    guint i;
+
+    if (nal_length_size) {
+        if (*offset + nal_length_size > size) return FALSE;
+        for (i = 0; i < nal_length_size; i++) {
+            len = (len << 8) | data[*offset + i];
+        }
+        *offset += nal_length_size;
+        if (len > size - *offset) return FALSE;
+        *nal = data + *offset;
+        *nal_size = len;
+        *offset += len;
+        return TRUE;
+    }
+
+    start = gst_es_h26x_find_start_code(data, size, *offset);
+    if (start < 0) return FALSE;
+    start += 3;
+    end = gst_es_h26x_find_start_code(data, size, start);
+    if (end < 0) {
+        end = size;
+    } else {
+        // trailing zeros belong to the next start code
+        while (end > start && !data[end - 1]) end--;
+    }
+    *nal = data + start;
+    *nal_size = end - start;
+    *offset = end;
+    return TRUE;
+}
+
+/* True if no slice of the access unit is used as reference by later pictures.
+ * max_tid is the highest hevc temporal id of the sps, -1 while unknown. */
+gboolean gst_es_h26x_is_droppable(
+    const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc, gint max_tid) {
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+    gboolean found_slice = FALSE;
+    guint type;
+    gint tid;
+
+    // higher sub-layers may reference any picture until the sps tells which layer is the top
+    if (is_hevc && max_tid < 0) return FALSE;
+
+    while (gst_es_h26x_next_nal(data, size, nal_length_size, &offset, &nal, &nal_size)) {
+        if (is_hevc) {
+            if (nal_size < 2 || !(nal[1] & 0x7)) continue;
+            type = (nal[0] >> 1) & 0x3f;
+            if (type > H265_NAL_RSV_VCL31) continue;
+            tid = (nal[1] & 0x7) - 1;
+            // only sub-layer non-reference pictures of the highest sub-layer are never referenced
+            if (type > H265_NAL_RSV_VCL_N14 || type % 2 || tid < max_tid) return FALSE;
+        } else {
+            if (nal_size < 1) continue;
+            type = nal[0] & 0x1f;
+            if (type < H264_NAL_SLICE || type > H264_NAL_SLICE_IDR) continue;
+            // nal_ref_idc
+            if (nal[0] & 0x60) return FALSE;
+        }
+        found_slice = TRUE;
+    }
+    return found_slice;
+}
+
+static void bit_reader_init(GstEsBitReader *br, const guint8 *data, gsize size) {
+    memset(br, 0, sizeof(GstEsBitReader));
+    br->data = data;
+    br->size = size;
+}
+
+static guint read_bit(GstEsBitReader *br) {
+    guint8 byte;
+
+    if (br->pos >= br->size) {
+        br->error = TRUE;
+        return 0;
+    }
+    byte = br->data[br->pos];
+    if (++br->bit == 8) {
+        br->bit = 0;
+        br->zeros = byte ? 0 : br->zeros + 1;
+        br->pos++;
+        if (br->zeros >= 2 && br->pos < br->size && br->data[br->pos] == 3) {
+            br->pos++;
+            br->zeros = 0;
+        }
+        return byte & 1;
+    }
+    return (byte >> (8 - br->bit)) & 1;
+}
+
+static guint32 read_bits(GstEsBitReader *br, guint n) {
+    guint32 val = 0;
+
+    while (n--) {
+        val = (val << 1) | read_bit(br);
+    }
+    return val;
+}
+
+static guint32 read_ue(GstEsBitReader *br) {
+    guint zeros = 0;
+
+    while (!read_bit(br) && !br->error) {
+        if (++zeros > 31) {
+            br->error = TRUE;
+            return 0;
+        }
+    }
+    return zeros ? (1u << zeros) - 1 + read_bits(br, zeros) : 0;
+}
+
+static void skip_h264_scaling_list(GstEsBitReader *br, guint size) {
+    gint last = 8, next = 8, delta;
+    guint32 code;
+    guint i;
+
+    for (i = 0; i < size && !br->error; i++) {
+        if (next) {
+            code = read_ue(br);
+            delta = code & 1 ? (gint)((code + 1) / 2) : -(gint)(code / 2);
+            next = (last + delta + 256) % 256;
+        }
+        last = next ? next : last;
+    }
+}
+
+/* coded size of an h264 sps, rbsp starts after the nal header */
+static gboolean parse_h264_sps(GstEsBitReader *br, gint *width, gint *height) {
+    guint profile_idc, chroma_format_idc = 1;
+    guint poc_type, i, n;
+    guint32 width_mbs, height_map_units, frame_mbs_only;
+
+    profile_idc = read_bits(br, 8);
+    read_bits(br, 16);  // constraint flags, level_idc
+    read_ue(br);        // seq_parameter_set_id
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 || profile_idc == 44
+        || profile_idc == 83 || profile_idc == 86 || profile_idc == 118 || profile_idc == 128 || profile_idc == 138
+        || profile_idc == 139 || profile_idc == 134 || profile_idc == 135) {
+        chroma_format_idc = read_ue(br);
+        if (chroma_format_idc == 3) read_bit(br);  // separate_colour_plane_flag
+        read_ue(br);                               // bit_depth_luma_minus8
+        read_ue(br);                               // bit_depth_chroma_minus8
+        read_bit(br);                              // qpprime_y_zero_transform_bypass_flag
+        if (read_bit(br)) {
+            n = chroma_format_idc == 3 ? 12 : 8;
+            for (i = 0; i < n && !br->error; i++) {
+                if (read_bit(br)) skip_h264_scaling_list(br, i < 6 ? 16 : 64);
+            }
+        }
+    }
+    read_ue(br);  // log2_max_frame_num_minus4
+    poc_type = read_ue(br);
+    if (poc_type == 0) {
+        read_ue(br);  // log2_max_pic_order_cnt_lsb_minus4
+    } else if (poc_type == 1) {
+        read_bit(br);  // delta_pic_order_always_zero_flag
+        read_ue(br);   // offset_for_non_ref_pic
+        read_ue(br);   // offset_for_top_to_bottom_field
+        n = read_ue(br);
+        for (i = 0; i < n && !br->error; i++) {
+            read_ue(br);  // offset_for_ref_frame
+        }
+    }
+    read_ue(br);  // max_num_ref_frames
+    read_bit(br);  // gaps_in_frame_num_value_allowed_flag
+    width_mbs = read_ue(br) + 1;
+    height_map_units = read_ue(br) + 1;
+    frame_mbs_only = read_bit(br);
+    if (br->error) return FALSE;
+
+    *width = width_mbs * 16;
+    *height = height_map_units * 16 * (2 - frame_mbs_only);
+    return TRUE;
+}
+
+/* the sps fields up to sps_seq_parameter_set_id, general and sub-layer profile_tier_level included */
+static void skip_h265_sps_header(GstEsBitReader *br) {
+    guint max_sub_layers_minus1, i;
+    guint8 profile_present[8] = {0}, level_present[8] = {0};
+
+    read_bits(br, 4);  // sps_video_parameter_set_id
+    max_sub_layers_minus1 = read_bits(br, 3);
+    read_bit(br);  // sps_temporal_id_nesting_flag
+    // general profile_tier_level
+    read_bits(br, 8);
+    read_bits(br, 32);
+    read_bits(br, 32);
+    read_bits(br, 16);
+    read_bits(br, 8);
+    for (i = 0; i < max_sub_layers_minus1; i++) {
+        profile_present[i] = read_bit(br);
+        level_present[i] = read_bit(br);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        for (i = max_sub_layers_minus1; i < 8; i++) {
+            read_bits(br, 2);  // reserved_zero_2bits
+        }
+    }
+    for (i = 0; i < max_sub_layers_minus1; i++) {
+        if (profile_present[i]) {
+            read_bits(br, 32);
+            read_bits(br, 32);
+            read_bits(br, 24);
+        }
+        if (level_present[i]) read_bits(br, 8);
+    }
+}
+
+/* coded size of an hevc sps, rbsp starts after the nal header */
+static gboolean parse_h265_sps(GstEsBitReader *br, gint *width, gint *height) {
+    skip_h265_sps_header(br);
+    read_ue(br);  // sps_seq_parameter_set_id
+    if (read_ue(br) == 3) read_bit(br);  // chroma_format_idc, separate_colour_plane_flag
+    *width = read_ue(br);
+    *height = read_ue(br);
+    return !br->error && *width > 0 && *height > 0;
+}
+
+/* coded picture size of the first sps carried by the access unit, if any */
+gboolean gst_es_h26x_get_sps_size(
+    const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc, gint *width, gint *height) {
+    GstEsBitReader br;
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+
+    while (gst_es_h26x_next_nal(data, size, nal_length_size, &offset, &nal, &nal_size)) {
+        if (is_hevc) {
+            if (nal_size < 3 || ((nal[0] >> 1) & 0x3f) != H265_NAL_SPS) continue;
+            bit_reader_init(&br, nal + 2, nal_size - 2);
+            return parse_h265_sps(&br, width, height);
+        }
+        if (nal_size < 2 || (nal[0] & 0x1f) != H264_NAL_SPS) continue;
+        bit_reader_init(&br, nal + 1, nal_size - 1);
+        return parse_h264_sps(&br, width, height);
+    }
+    return FALSE;
+}
+
+/* highest hevc temporal id from sps_max_sub_layers_minus1 of the first sps carried by the access unit */
+gboolean gst_es_h26x_get_max_tid(const guint8 *data, gsize size, guint nal_length_size, gint *max_tid) {
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+
+    while (gst_es_h26x_next_nal(data, size, nal_length_size, &offset, &nal, &nal_size)) {
+        if (nal_size < 3 || ((nal[0] >> 1) & 0x3f) != H265_NAL_SPS) continue;
+        // sps_video_parameter_set_id u(4), sps_max_sub_layers_minus1 u(3)
+        *max_tid = (nal[2] >> 1) & 0x7;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* true if the access unit is an idr picture, nothing after it references earlier pictures */
+gboolean gst_es_h26x_is_idr(const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc) {
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+    guint type;
+
+    while (gst_es_h26x_next_nal(data, size, nal_length_size, &offset, &nal, &nal_size)) {
+        if (!nal_size) continue;
+        if (is_hevc) {
+            type = (nal[0] >> 1) & 0x3f;
+            // cra and bla may be followed by leading pictures of the previous gop
+            if (type > H265_NAL_RSV_VCL31) continue;
+            return type == H265_NAL_IDR_W_RADL || type == H265_NAL_IDR_N_LP;
+        }
+        type = nal[0] & 0x1f;
+        if (type < H264_NAL_SLICE || type > H264_NAL_SLICE_IDR) continue;
+        return type == H264_NAL_SLICE_IDR;
+    }
+    return FALSE;
+}
+
+/* Access unit boundaries of byte-stream input (H.264 7.4.1.2.3, H.265 7.4.2.4.4).
+ * TRUE if the nal begins a new access unit once the current one holds a picture. */
+gboolean gst_es_h26x_nal_starts_au(
+    const guint8 *nal, gsize nal_size, gboolean is_hevc, gboolean *is_vcl, gboolean *is_irap) {
+    guint type;
+
+    *is_vcl = *is_irap = FALSE;
+    if (is_hevc) {
+        if (nal_size < 3) return FALSE;
+        type = (nal[0] >> 1) & 0x3f;
+        if (type <= H265_NAL_RSV_VCL31) {
+            *is_vcl = TRUE;
+            *is_irap = type >= H265_NAL_BLA_W_LP && type <= H265_NAL_RSV_IRAP23;
+            // first_slice_segment_in_pic_flag
+            return (nal[2] & 0x80) != 0;
+        }
+        return (type >= H265_NAL_VPS && type <= H265_NAL_AUD) || type == H265_NAL_PREFIX_SEI
+               || (type >= H265_NAL_RSV41 && type <= H265_NAL_RSV44)
+               || (type >= H265_NAL_UNSPEC48 && type <= H265_NAL_UNSPEC55);
+    }
+    if (nal_size < 2) return FALSE;
+    type = nal[0] & 0x1f;
+    if (type >= H264_NAL_SLICE && type <= H264_NAL_SLICE_IDR) {
+        *is_vcl = TRUE;
+        *is_irap = type == H264_NAL_SLICE_IDR;
+        // first_mb_in_slice is 0, a single bit ue(v)
+        return (nal[1] & 0x80) != 0;
+    }
+    return (type >= H264_NAL_SEI && type <= H264_NAL_AUD) || (type >= H264_NAL_PREFIX && type <= H264_NAL_RSV18);
+}
+
+/* slot of a parameter set in GstEsH26xParamSets, vps then sps then pps by id, -1 if not one */
+static gint get_param_set_slot(const guint8 *nal, gsize nal_size, gboolean is_hevc) {
+    GstEsBitReader br;
+    guint type, id, base, limit;
+
+    if (is_hevc) {
+        if (nal_size < 3) return -1;
+        type = (nal[0] >> 1) & 0x3f;
+        bit_reader_init(&br, nal + 2, nal_size - 2);
+        switch (type) {
+            case H265_NAL_VPS:
+                id = read_bits(&br, 4);
+                base = 0;
+                limit = GST_ES_H26X_MAX_VPS;
+                break;
+            case H265_NAL_SPS:
+                skip_h265_sps_header(&br);
+                id = read_ue(&br);
+                base = GST_ES_H26X_MAX_VPS;
+                limit = GST_ES_H26X_MAX_SPS;
+                break;
+            case H265_NAL_PPS:
+                id = read_ue(&br);
+                base = GST_ES_H26X_MAX_VPS + GST_ES_H26X_MAX_SPS;
+                limit = GST_ES_H26X_MAX_PPS;
+                break;
+            default:
+                return -1;
+        }
+    } else {
+        if (nal_size < 2) return -1;
+        type = nal[0] & 0x1f;
+        bit_reader_init(&br, nal + 1, nal_size - 1);
+        if (type == H264_NAL_SPS) {
+            read_bits(&br, 24);  // profile_idc, constraint flags, level_idc
+            id = read_ue(&br);
+            base = GST_ES_H26X_MAX_VPS;
+            limit = GST_ES_H26X_MAX_SPS;
+        } else if (type == H264_NAL_PPS) {
+            id = read_ue(&br);
+            base = GST_ES_H26X_MAX_VPS + GST_ES_H26X_MAX_SPS;
+            limit = GST_ES_H26X_MAX_PPS;
+        } else {
+            return -1;
+        }
+    }
+    if (br.error || id >= limit) return -1;
+    return base + id;
+}
+
+/* keep the parameter sets carried by the access unit, replacing earlier ones of the same id */
+void gst_es_h26x_param_sets_update(
+    GstEsH26xParamSets *sets, const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc) {
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+    gint slot;
+
+    while (gst_es_h26x_next_nal(data, size, nal_length_size, &offset, &nal, &nal_size)) {
+        slot = get_param_set_slot(nal, nal_size, is_hevc);
+        if (slot < 0) continue;
+        g_free(sets->nals[slot]);
+        sets->nals[slot] = g_malloc(nal_size);
+        memcpy(sets->nals[slot], nal, nal_size);
+        sets->sizes[slot] = nal_size;
+    }
+}
+
+/* Kept parameter sets the access unit does not carry itself, in the framing of
+ * the input and in vps, sps, pps order. NULL if it lacks none. */
+GstBuffer *gst_es_h26x_param_sets_missing(
+    const GstEsH26xParamSets *sets, const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc) {
+    gboolean carried[GST_ES_H26X_MAX_PARAM_SETS] = {FALSE};
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+    guint8 *out, *pos;
+    guint prefix = nal_length_size ? nal_length_size : 4;
+    gsize total = 0;
+    gint slot;
+    guint i, j;
+
+    while (gst_es_h26x_next_nal(data, size, nal_length_size, &offset, &nal, &nal_size)) {
+        slot = get_param_set_slot(nal, nal_size, is_hevc);
+        if (slot >= 0) carried[slot] = TRUE;
+    }
+    for (i = 0; i < GST_ES_H26X_MAX_PARAM_SETS; i++) {
+        if (sets->nals[i] && !carried[i]) total += prefix + sets->sizes[i];
+    }
+    if (!total) return NULL;
+
+    out = pos = g_malloc(total);
+    for (i = 0; i < GST_ES_H26X_MAX_PARAM_SETS; i++) {
+        if (!sets->nals[i] || carried[i]) continue;
+        for (j = 0; j < prefix; j++) {
+            // big endian length, or the 00 00 00 01 start code
+            pos[j] = nal_length_size ? (sets->sizes[i] >> (8 * (prefix - 1 - j))) & 0xff : (j == prefix - 1);
+        }
+        memcpy(pos + prefix, sets->nals[i], sets->sizes[i]);
+        pos += prefix + sets->sizes[i];
+    }
+    return gst_buffer_new_wrapped(out, total);
+}
+
+void gst_es_h26x_param_sets_clear(GstEsH26xParamSets *sets) {
+    guint i;
+
+    for (i = 0; i < GST_ES_H26X_MAX_PARAM_SETS; i++) {
+        g_free(sets->nals[i]);
+    }
+    memset(sets, 0, sizeof(GstEsH26xParamSets));
+}
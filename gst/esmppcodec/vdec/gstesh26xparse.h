@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Liujie <liujie@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_ES_H26X_PARSE_H__
+#define __GST_ES_H26X_PARSE_H__
+
+#include <gst/gst.h>
+
+#define GST_ES_H26X_MAX_VPS (16)
+#define GST_ES_H26X_MAX_SPS (32)
+#define GST_ES_H26X_MAX_PPS (256)
+#define GST_ES_H26X_MAX_PARAM_SETS (GST_ES_H26X_MAX_VPS + GST_ES_H26X_MAX_SPS + GST_ES_H26X_MAX_PPS)
+
+/* latest parameter sets of a stream, vps then sps then pps by id */
+typedef struct {
+    guint8 *nals[GST_ES_H26X_MAX_PARAM_SETS]; /* nal without start code or length prefix */
+    gsize sizes[GST_ES_H26X_MAX_PARAM_SETS];
+} GstEsH26xParamSets;
+
+/* nal_length_size is 0 for byte-stream input, else the size of the avc/hvc length prefix */
+guint gst_es_h26x_get_nal_length_size(const gchar *stream_format, GstBuffer *codec_data);
+
+gboolean gst_es_h26x_get_hvcc_max_tid(GstBuffer *codec_data, gint *max_tid);
+
+gssize gst_es_h26x_find_start_code(const guint8 *data, gsize size, gsize offset);
+
+gboolean gst_es_h26x_next_nal(
+    const guint8 *data, gsize size, guint nal_length_size, gsize *offset, const guint8 **nal, gsize *nal_size);
+
+gboolean gst_es_h26x_is_droppable(
+    const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc, gint max_tid);
+
+gboolean gst_es_h26x_get_sps_size(
+    const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc, gint *width, gint *height);
+
+gboolean gst_es_h26x_get_max_tid(const guint8 *data, gsize size, guint nal_length_size, gint *max_tid);
+
+gboolean gst_es_h26x_is_idr(const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc);
+
+gboolean gst_es_h26x_nal_starts_au(
+    const guint8 *nal, gsize nal_size, gboolean is_hevc, gboolean *is_vcl, gboolean *is_irap);
+
+void gst_es_h26x_param_sets_update(
+    GstEsH26xParamSets *sets, const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc);
+
+GstBuffer *gst_es_h26x_param_sets_missing(
+    const GstEsH26xParamSets *sets, const guint8 *data, gsize size, guint nal_length_size, gboolean is_hevc);
+
+void gst_es_h26x_param_sets_clear(GstEsH26xParamSets *sets);
+
+#endif
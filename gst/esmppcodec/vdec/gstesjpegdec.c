@@ -22,16 +22,49 @@
 #include "config.h"
 #endif
 
+#include <string.h>
 #include "gstesjpegdec.h"
 #include "gstesdec_comm.h"
+#include "gstesjpegparse.h"
 
 #define GST_ES_JPEG_DEC(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_ES_JPEG_DEC, GstEsJpegDec))
 
 #define GST_CAT_DEFAULT es_jpeg_dec_debug
 GST_DEBUG_CATEGORY(GST_CAT_DEFAULT);
+
+#define CACHE_MAX_ENTRIES (16)
+
+enum {
+    PROP_CACHE_SIZE = PROP_N_CONTEXTS + 1,
+    PROP_CACHE_MAX_MB,
+    PROP_CACHE_HITS,
+    PROP_CACHE_MISSES,
+};
+
+/* decoded picture of a bitstream for one output configuration */
+typedef struct {
+    guint64 hash;
+    GBytes *bitstream;
+    GstVideoFormat format;
+    gint width; /* scaled size, 0 when not scaled */
+    gint height;
+    guint crop[4];
+    guint stride_align;
+    GstBuffer *buffer; /* shares the output memory, which holds the mpp buffer, not the pool wrapper */
+} GstEsJpegCacheEntry;
+
 struct _GstEsJpegDec {
     GstEsDec parent;
     gint poll_timeout;
+    GstEsJpegScan scan; /* parse state of unparsed input */
+    gint width;         /* size of the last parsed frame */
+    gint height;
+    gint cache_size;   /* config max cached pictures, 0 disables the cache */
+    gint cache_max_mb; /* config max memory of the cached pictures and bitstreams, 0 for no limit */
+    GQueue cache;      /* GstEsJpegCacheEntry, most recently used first */
+    gsize cache_bytes;
+    guint cache_hits;
+    guint cache_misses;
 };
 
 #define parent_class gst_es_jpeg_dec_parent_class
@@ -42,9 +75,7 @@ static GstStaticPadTemplate gst_es_jpeg_dec_sink_template =
     GST_STATIC_PAD_TEMPLATE("sink",
                             GST_PAD_SINK,
                             GST_PAD_ALWAYS,
-                            GST_STATIC_CAPS("image/jpeg,"
-                                            "parsed = (boolean) true"
-                                            ";"));
+                            GST_STATIC_CAPS("image/jpeg"));
 
 #define ES_JPEG_FORMATS     \
     "NV12, NV21, YUV420P, " \
@@ -55,22 +86,19 @@ static GstStaticPadTemplate gst_es_jpeg_dec_src_template =
     GST_STATIC_PAD_TEMPLATE("src",
                             GST_PAD_SRC,
                             GST_PAD_ALWAYS,
-                            GST_STATIC_CAPS("video/x-raw, "
+                            GST_STATIC_CAPS("video/x-raw(memory:DMABuf), "
+                                            "format = (string) DMA_DRM, "
+                                            "width = (int) [ 48, 32768 ], height = (int) [ 48, 32768 ]"
+                                            ";"
+                                            "video/x-raw, "
                                             "format = (string) {" ES_JPEG_FORMATS " }, "
                                             "width = (int) [ 48, 32768 ], height = (int) [ 48, 32768 ]"
                                             ";"));
 
-static gboolean gst_es_jpeg_dec_set_format(GstVideoDecoder *decoder, GstVideoCodecState *state) {
-    GstVideoDecoderClass *pclass = GST_VIDEO_DECODER_CLASS(parent_class);
-    GstEsDec *esdec = GST_ES_DEC(decoder);
-
-    esdec->mpp_coding_type = MPP_VIDEO_CodingMJPEG;
-    return pclass->set_format(decoder, state);
-}
-
 static void gst_es_jpeg_dec_init(GstEsJpegDec *self) {
     GstEsDec *esdec = GST_ES_DEC(self);
     gst_es_comm_dec_set_default_fmt(esdec, "GST_ES_JPEG_DEC_DEF_FMT");
+    g_queue_init(&self->cache);
 }
 
 static gboolean gst_es_jpeg_dec_set_extra_data(GstVideoDecoder *decoder) {
@@ -83,11 +111,12 @@ static gboolean gst_es_jpeg_dec_set_extra_data(GstVideoDecoder *decoder) {
     return FALSE;
 }
 
-static MppPacketPtr gst_es_jpeg_dec_prepare_mpp_packet(GstVideoDecoder *decoder, GstMapInfo *mapinfo) {
-    (void)(decoder);
-    MppPacketPtr mpp_packet = NULL;
-    mpp_packet_init(&mpp_packet, mapinfo->data, mapinfo->size);
-    return mpp_packet;
+static MppPacketPtr gst_es_jpeg_dec_prepare_mpp_packet(GstVideoDecoder *decoder,
+                                                     GstBuffer *buffer,
+                                                     GstMapInfo *mapinfo,
+                                                     gboolean *imported) {
+    GstEsDec *esdec = GST_ES_DEC(decoder);
+    return gst_es_comm_dec_prepare_mpp_packet(esdec, buffer, mapinfo, imported);
 }
 
 static gint gst_es_jpeg_dec_send_mpp_packet(GstVideoDecoder *decoder, MppPacketPtr mpp_packet, gint timeout_ms) {
@@ -102,10 +131,288 @@ static MppFramePtr gst_es_jpeg_dec_get_mpp_frame(GstVideoDecoder *decoder, gint
     if (self->poll_timeout != timeout_ms) {
         self->poll_timeout = timeout_ms;
     }
-    esmpp_get_frame(esdec->mpp_ctx, &mpp_frame, self->poll_timeout);
+    mpp_frame = gst_es_comm_dec_get_mpp_frame(esdec, self->poll_timeout);
     return mpp_frame;
 }
 
+static void update_frame_info(GstEsJpegDec *self, const guint8 *data, gsize size) {
+    const gchar *sampling = NULL;
+    gint width, height;
+
+    if (!gst_es_jpeg_get_frame_info(data, size, &width, &height, &sampling)) {
+        return;
+    }
+    if (width != self->width || height != self->height) {
+        GST_DEBUG_OBJECT(self, "frame %dx%d sampling %s", width, height, GST_STR_NULL(sampling));
+        self->width = width;
+        self->height = height;
+    }
+}
+
+/* split unparsed image/jpeg input on SOI/EOI, the markers in between are skipped by their length */
+static GstFlowReturn gst_es_jpeg_dec_parse(GstVideoDecoder *decoder,
+                                           GstVideoCodecFrame *frame,
+                                           GstAdapter *adapter,
+                                           gboolean at_eos) {
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+    gsize size, frame_size = 0, header_size;
+    gssize soi;
+    gboolean found;
+
+    size = gst_adapter_available(adapter);
+    if (size < 4) {
+        goto need_data;
+    }
+    if (!self->scan.offset) {
+        soi = gst_es_jpeg_find_soi(adapter);
+        if (soi != 0) {
+            // keep the tail that may hold a partial SOI
+            gst_adapter_flush(adapter, soi > 0 ? (gsize)soi : size - 3);
+            GST_DEBUG_OBJECT(self, "skipped %" G_GSIZE_FORMAT " bytes before SOI", soi > 0 ? (gsize)soi : size - 3);
+            return GST_FLOW_OK;
+        }
+    }
+    found = gst_es_jpeg_scan_frame(adapter, &self->scan, &frame_size);
+    if (!found && at_eos) {
+        // truncated last frame, let the decoder conceal it
+        memset(&self->scan, 0, sizeof(GstEsJpegScan));
+        frame_size = size;
+        found = TRUE;
+    }
+    if (!found) {
+        goto need_data;
+    }
+    // the frame header is before the first scan, only that much is mapped
+    header_size = self->scan.header_size ? self->scan.header_size : frame_size;
+    update_frame_info(self, gst_adapter_map(adapter, header_size), header_size);
+    gst_adapter_unmap(adapter);
+
+    // every picture decodes on its own
+    GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT(frame);
+    gst_video_decoder_add_to_frame(decoder, frame_size);
+    return gst_video_decoder_have_frame(decoder);
+
+need_data:
+    if (at_eos) {
+        gst_adapter_flush(adapter, size);
+    }
+    return GST_VIDEO_DECODER_FLOW_NEED_DATA;
+}
+
+/* the frame header of each picture, lets the base class prepare for a new size */
+static gboolean gst_es_jpeg_dec_get_sequence_size(GstVideoDecoder *decoder,
+                                                  GstVideoCodecFrame *frame,
+                                                  gint *width,
+                                                  gint *height) {
+    GstMapInfo mapinfo;
+    gboolean found;
+
+    if (!gst_buffer_map(frame->input_buffer, &mapinfo, GST_MAP_READ)) {
+        return FALSE;
+    }
+    found = gst_es_jpeg_get_frame_info(mapinfo.data, mapinfo.size, width, height, NULL);
+    gst_buffer_unmap(frame->input_buffer, &mapinfo);
+    return found;
+}
+
+/* fast 64 bit hash of the bitstream, candidates are compared in full */
+static guint64 hash_bitstream(const guint8 *data, gsize size) {
+    guint64 hash = 0xcbf29ce484222325ULL ^ size;
+    guint64 word;
+    gsize i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void cache_entry_free(gpointer data) {
+    GstEsJpegCacheEntry *entry = data;
+
+    if (entry->bitstream) {
+        g_bytes_unref(entry->bitstream);
+    }
+    if (entry->buffer) {
+        gst_buffer_unref(entry->buffer);
+    }
+    g_free(entry);
+}
+
+static gsize cache_entry_bytes(GstEsJpegCacheEntry *entry) {
+    return gst_buffer_get_size(entry->buffer) + g_bytes_get_size(entry->bitstream);
+}
+
+static void cache_key_init(GstEsJpegDec *self, GstEsJpegCacheEntry *key, const guint8 *data, gsize size) {
+    GstEsDec *esdec = GST_ES_DEC(self);
+
+    memset(key, 0, sizeof(GstEsJpegCacheEntry));
+    key->hash = hash_bitstream(data, size);
+    key->format = esdec->out_format;
+    key->width = esdec->out_width ? esdec->out_width : esdec->scale_width;
+    key->height = esdec->out_height ? esdec->out_height : esdec->scale_height;
+    key->crop[0] = esdec->crop_x;
+    key->crop[1] = esdec->crop_y;
+    key->crop[2] = esdec->crop_w;
+    key->crop[3] = esdec->crop_h;
+    key->stride_align = esdec->stride_align;
+}
+
+static gboolean cache_entry_matches(GstEsJpegCacheEntry *entry,
+                                    GstEsJpegCacheEntry *key,
+                                    const guint8 *data,
+                                    gsize size) {
+    const guint8 *bytes;
+    gsize len;
+
+    if (entry->hash != key->hash || entry->format != key->format || entry->width != key->width
+        || entry->height != key->height || entry->stride_align != key->stride_align
+        || memcmp(entry->crop, key->crop, sizeof(entry->crop))) {
+        return FALSE;
+    }
+    bytes = g_bytes_get_data(entry->bitstream, &len);
+    return len == size && !memcmp(bytes, data, size);
+}
+
+static GstEsJpegCacheEntry *cache_lookup(GstEsJpegDec *self, GstEsJpegCacheEntry *key, const guint8 *data, gsize size) {
+    GList *l;
+
+    for (l = self->cache.head; l; l = l->next) {
+        if (cache_entry_matches(l->data, key, data, size)) {
+            // most recently used first
+            g_queue_unlink(&self->cache, l);
+            g_queue_push_head_link(&self->cache, l);
+            return l->data;
+        }
+    }
+    return NULL;
+}
+
+static void cache_trim(GstEsJpegDec *self) {
+    GstEsJpegCacheEntry *entry;
+    gsize max_bytes = (gsize)self->cache_max_mb << 20;
+
+    while (g_queue_get_length(&self->cache) > (guint)self->cache_size
+           || (max_bytes && self->cache_bytes > max_bytes && !g_queue_is_empty(&self->cache))) {
+        entry = g_queue_pop_tail(&self->cache);
+        self->cache_bytes -= cache_entry_bytes(entry);
+        cache_entry_free(entry);
+    }
+}
+
+static void cache_clear(GstEsJpegDec *self) {
+    g_queue_clear_full(&self->cache, cache_entry_free);
+    self->cache_bytes = 0;
+}
+
+static gboolean gst_es_jpeg_dec_set_format(GstVideoDecoder *decoder, GstVideoCodecState *state) {
+    GstVideoDecoderClass *pclass = GST_VIDEO_DECODER_CLASS(parent_class);
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+    GstEsDec *esdec = GST_ES_DEC(decoder);
+    gboolean parsed = FALSE;
+
+    esdec->mpp_coding_type = MPP_VIDEO_CodingMJPEG;
+    // unparsed input is split into frames by the parse vfunc
+    gst_structure_get_boolean(gst_caps_get_structure(state->caps, 0), "parsed", &parsed);
+    gst_video_decoder_set_packetized(decoder, parsed);
+    memset(&self->scan, 0, sizeof(GstEsJpegScan));
+    cache_clear(self);
+    if (!esdec->input_state) {
+        gst_es_comm_dec_negotiate_format(esdec);
+    }
+    return pclass->set_format(decoder, state);
+}
+
+static GstFlowReturn gst_es_jpeg_dec_handle_frame(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstVideoDecoderClass *pclass = GST_VIDEO_DECODER_CLASS(parent_class);
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+    GstEsJpegCacheEntry key, *entry;
+    GstVideoCodecFrame *oldest;
+    GstMapInfo mapinfo;
+
+    if (!self->cache_size || !gst_buffer_map(frame->input_buffer, &mapinfo, GST_MAP_READ)) {
+        return pclass->handle_frame(decoder, frame);
+    }
+    cache_key_init(self, &key, mapinfo.data, mapinfo.size);
+    entry = cache_lookup(self, &key, mapinfo.data, mapinfo.size);
+    if (!entry) {
+        self->cache_misses++;
+        // completed in frame_decoded, freed with the frame otherwise
+        entry = g_new0(GstEsJpegCacheEntry, 1);
+        *entry = key;
+        entry->bitstream = g_bytes_new(mapinfo.data, mapinfo.size);
+        gst_video_codec_frame_set_user_data(frame, entry, cache_entry_free);
+        gst_buffer_unmap(frame->input_buffer, &mapinfo);
+        return pclass->handle_frame(decoder, frame);
+    }
+    gst_buffer_unmap(frame->input_buffer, &mapinfo);
+
+    self->cache_hits++;
+    GST_TRACE_OBJECT(self, "frame %u found in the decode cache", frame->system_frame_number);
+    frame->output_buffer = gst_buffer_copy(entry->buffer);
+    oldest = gst_video_decoder_get_oldest_frame(decoder);
+    if (oldest) {
+        gst_video_codec_frame_unref(oldest);
+    }
+    if (oldest == frame) {
+        return gst_video_decoder_finish_frame(decoder, frame);
+    }
+    // the output loop finishes it after the frames still in mpp
+    gst_video_codec_frame_unref(frame);
+    return GST_FLOW_OK;
+}
+
+static void gst_es_jpeg_dec_frame_decoded(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+    GstEsJpegCacheEntry *pending = gst_video_codec_frame_get_user_data(frame);
+    GstEsJpegCacheEntry *entry;
+
+    if (!self->cache_size || !pending || !frame->output_buffer) {
+        return;
+    }
+    entry = g_new0(GstEsJpegCacheEntry, 1);
+    *entry = *pending;
+    pending->bitstream = NULL;
+    gst_video_codec_frame_set_user_data(frame, NULL, NULL);
+
+    // the pool wrapper goes back on release, downstream and the cache keep the memory
+    entry->buffer = gst_buffer_copy_region(frame->output_buffer, GST_BUFFER_COPY_MEMORY | GST_BUFFER_COPY_META, 0, -1);
+    self->cache_bytes += cache_entry_bytes(entry);
+    g_queue_push_head(&self->cache, entry);
+    cache_trim(self);
+}
+
+static gboolean gst_es_jpeg_dec_stop(GstVideoDecoder *decoder) {
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+
+    GST_DEBUG_OBJECT(self, "decode cache hits %u misses %u", self->cache_hits, self->cache_misses);
+    cache_clear(self);
+    memset(&self->scan, 0, sizeof(GstEsJpegScan));
+    self->width = self->height = 0;
+    return GST_VIDEO_DECODER_CLASS(parent_class)->stop(decoder);
+}
+
+static gboolean gst_es_jpeg_dec_flush(GstVideoDecoder *decoder) {
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+
+    cache_clear(self);
+    memset(&self->scan, 0, sizeof(GstEsJpegScan));
+    return GST_VIDEO_DECODER_CLASS(parent_class)->flush(decoder);
+}
+
+/* cached pictures belong to the previous pool and layout */
+static gboolean gst_es_jpeg_dec_decide_allocation(GstVideoDecoder *decoder, GstQuery *query) {
+    GstEsJpegDec *self = GST_ES_JPEG_DEC(decoder);
+
+    cache_clear(self);
+    return GST_VIDEO_DECODER_CLASS(parent_class)->decide_allocation(decoder, query);
+}
+
 static gboolean gst_es_jpeg_dec_shutdown(GstVideoDecoder *decoder, gboolean drain) {
     GstEsDec *esdec = GST_ES_DEC(decoder);
     return gst_es_comm_dec_shutdown(esdec, drain);
@@ -113,8 +420,28 @@ static gboolean gst_es_jpeg_dec_shutdown(GstVideoDecoder *decoder, gboolean drai
 
 static void gst_es_jpeg_dec_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
     GstVideoDecoder *decoder = GST_VIDEO_DECODER(object);
+    GstEsJpegDec *jpegdec = GST_ES_JPEG_DEC(object);
     GstEsDec *self = GST_ES_DEC(decoder);
-    gst_es_comm_dec_set_property(self, prop_id, value, pspec);
+
+    switch (prop_id) {
+        case PROP_CACHE_SIZE: {
+            // cached pictures stay out of the mpp group, which is sized on the next info change
+            if (self->input_state)
+                GST_WARNING_OBJECT(self, "unable to change cache size");
+            else {
+                jpegdec->cache_size = g_value_get_int(value);
+                self->held_buffers = jpegdec->cache_size;
+            }
+            break;
+        }
+        case PROP_CACHE_MAX_MB: {
+            jpegdec->cache_max_mb = g_value_get_int(value);
+            break;
+        }
+        default:
+            gst_es_comm_dec_set_property(self, prop_id, value, pspec);
+            break;
+    }
 }
 
 static void gst_es_jpeg_dec_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
@@ -126,6 +453,26 @@ static void gst_es_jpeg_dec_get_property(GObject *object, guint prop_id, GValue
             g_value_set_string(value, gst_es_comm_dec_get_name_by_gst_video_format(self->out_format));
             break;
         }
+        case PROP_N_CONTEXTS: {
+            g_value_set_int(value, self->contexts);
+            break;
+        }
+        case PROP_CACHE_SIZE: {
+            g_value_set_int(value, GST_ES_JPEG_DEC(object)->cache_size);
+            break;
+        }
+        case PROP_CACHE_MAX_MB: {
+            g_value_set_int(value, GST_ES_JPEG_DEC(object)->cache_max_mb);
+            break;
+        }
+        case PROP_CACHE_HITS: {
+            g_value_set_int(value, GST_ES_JPEG_DEC(object)->cache_hits);
+            break;
+        }
+        case PROP_CACHE_MISSES: {
+            g_value_set_int(value, GST_ES_JPEG_DEC(object)->cache_misses);
+            break;
+        }
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
             return;
@@ -141,12 +488,19 @@ static void gst_es_jpeg_dec_class_init(GstEsJpegDecClass *klass) {
     GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "esjpegdec", 0, "ES JPEG decoder");
 
     decoder_class->set_format = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_set_format);
+    decoder_class->handle_frame = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_handle_frame);
+    decoder_class->parse = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_parse);
+    decoder_class->flush = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_flush);
+    decoder_class->stop = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_stop);
+    decoder_class->decide_allocation = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_decide_allocation);
 
     pclass->set_extra_data = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_set_extra_data);
     pclass->prepare_mpp_packet = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_prepare_mpp_packet);
     pclass->send_mpp_packet = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_send_mpp_packet);
     pclass->get_mpp_frame = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_get_mpp_frame);
     pclass->shutdown = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_shutdown);
+    pclass->frame_decoded = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_frame_decoded);
+    pclass->get_sequence_size = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_get_sequence_size);
 
     gobject_class->set_property = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_set_property);
     gobject_class->get_property = GST_DEBUG_FUNCPTR(gst_es_jpeg_dec_get_property);
@@ -159,6 +513,59 @@ static void gst_es_jpeg_dec_class_init(GstEsJpegDecClass *klass) {
                                                         "RGBA",
                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+    g_object_class_install_property(gobject_class,
+                                    PROP_N_CONTEXTS,
+                                    g_param_spec_int("n-contexts",
+                                                     "n-contexts",
+                                                     "Number of mpp contexts frames are decoded on in parallel, "
+                                                     "output keeps the input order",
+                                                     1,
+                                                     GST_ES_DEC_MAX_CONTEXTS,
+                                                     1,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_CACHE_SIZE,
+                                    g_param_spec_int("cache-size",
+                                                     "cache-size",
+                                                     "Max decoded pictures reused for byte-identical input, "
+                                                     "the bitstream of every decoded frame is copied for the "
+                                                     "comparison, 0-disable",
+                                                     0,
+                                                     CACHE_MAX_ENTRIES,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_CACHE_MAX_MB,
+                                    g_param_spec_int("cache-max-mb",
+                                                     "cache-max-mb",
+                                                     "Max MB held by the decode cache, 0-no limit",
+                                                     0,
+                                                     G_MAXINT >> 20,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_CACHE_HITS,
+                                    g_param_spec_int("cache-hits",
+                                                     "cache-hits",
+                                                     "Frames output from the decode cache",
+                                                     0,
+                                                     G_MAXINT,
+                                                     0,
+                                                     G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_CACHE_MISSES,
+                                    g_param_spec_int("cache-misses",
+                                                     "cache-misses",
+                                                     "Frames decoded while the decode cache is enabled",
+                                                     0,
+                                                     G_MAXINT,
+                                                     0,
+                                                     G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
     gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&gst_es_jpeg_dec_src_template));
 
     gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&gst_es_jpeg_dec_sink_template));
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Liujie <liujie@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "gstesjpegparse.h"
+
+#define JPEG_MARKER_SOF0 (0xc0)
+#define JPEG_MARKER_SOF15 (0xcf)
+#define JPEG_MARKER_DHT (0xc4)
+#define JPEG_MARKER_JPG (0xc8)
+#define JPEG_MARKER_DAC (0xcc)
+#define JPEG_MARKER_RST0 (0xd0)
+#define JPEG_MARKER_RST7 (0xd7)
+#define JPEG_MARKER_SOI (0xd8)
+#define JPEG_MARKER_EOI (0xd9)
+#define JPEG_MARKER_SOS (0xda)
+#define JPEG_MARKER_TEM (0x01)
+
+#define IS_RST(m) ((m) >= JPEG_MARKER_RST0 && (m) <= JPEG_MARKER_RST7)
+#define IS_SOF(m) ((m) >= JPEG_MARKER_SOF0 && (m) <= JPEG_MARKER_SOF15 && (m) != JPEG_MARKER_DHT \
+                   && (m) != JPEG_MARKER_JPG && (m) != JPEG_MARKER_DAC)
+
+/* offset of the next SOI followed by a marker, -1 if none */
+gssize gst_es_jpeg_find_soi(GstAdapter *adapter) {
+    gsize size = gst_adapter_available(adapter);
+
+    if (size < 4) {
+        return -1;
+    }
+    return gst_adapter_masked_scan_uint32(adapter, 0xffffff00, 0xffd8ff00, 0, size);
+}
+
+/* Walk the marker segments of the frame starting at the head of the adapter
+ * up to its EOI. Segments are skipped by their length and only their first
+ * 4 bytes are copied out, entropy coded data is scanned in place. */
+gboolean gst_es_jpeg_scan_frame(GstAdapter *adapter, GstEsJpegScan *scan, gsize *frame_size) {
+    gsize size = gst_adapter_available(adapter);
+    gsize offset = scan->offset;
+    guint8 header[4];
+    guint marker, len;
+    guint32 value;
+    gssize pos;
+
+    if (!offset) {
+        offset = 2;
+        scan->header_size = 0;
+    }
+    while (TRUE) {
+        // stuffed zeros and restart markers stay in the scan
+        while (scan->in_scan) {
+            // the 0xff is the third byte of the scanned word, so a byte follows it
+            pos = -1;
+            if (offset + 2 <= size) {
+                pos = gst_adapter_masked_scan_uint32_peek(
+                    adapter, 0x0000ff00, 0x0000ff00, offset - 2, size - offset + 2, &value);
+            }
+            if (pos < 0) {
+                scan->offset = MAX(offset, size - 1);
+                return FALSE;
+            }
+            offset = pos + 2;
+            marker = value & 0xff;
+            if (marker && !IS_RST(marker) && marker != 0xff) {
+                scan->in_scan = FALSE;
+                break;
+            }
+            offset += marker == 0xff ? 1 : 2;
+        }
+        if (offset + 2 > size) {
+            break;
+        }
+        gst_adapter_copy(adapter, header, offset, MIN(size - offset, 4));
+        if (header[0] != 0xff) {
+            // garbage between segments, resync on the next marker
+            offset++;
+            continue;
+        }
+        marker = header[1];
+        if (marker == 0xff) {
+            offset++;
+            continue;
+        }
+        if (marker == JPEG_MARKER_EOI) {
+            *frame_size = offset + 2;
+            scan->offset = 0;
+            scan->in_scan = FALSE;
+            return TRUE;
+        }
+        if (!marker || marker == JPEG_MARKER_TEM || marker == JPEG_MARKER_SOI || IS_RST(marker)) {
+            offset += 2;
+            continue;
+        }
+        if (offset + 4 > size) {
+            break;
+        }
+        len = GST_READ_UINT16_BE(header + 2);
+        if (len < 2) {
+            offset += 2;
+            continue;
+        }
+        if (offset + 2 + len > size) {
+            break;
+        }
+        if (marker == JPEG_MARKER_SOS && !scan->header_size) {
+            scan->header_size = offset;
+        }
+        offset += 2 + len;
+        scan->in_scan = marker == JPEG_MARKER_SOS;
+    }
+    scan->offset = offset;
+    return FALSE;
+}
+
+static const gchar *get_sampling(const guint8 *sof, guint components) {
+    guint h0, v0, h1, v1;
+
+    if (components == 1) {
+        return "GRAYSCALE";
+    }
+    if (components != 3) {
+        return NULL;
+    }
+    h0 = sof[7] >> 4;
+    v0 = sof[7] & 0xf;
+    h1 = sof[10] >> 4;
+    v1 = sof[10] & 0xf;
+    // chroma components are expected to share the same factors
+    if (h1 != (guint)(sof[13] >> 4) || v1 != (guint)(sof[13] & 0xf) || !h1 || !v1) {
+        return NULL;
+    }
+    if (h0 == h1 && v0 == v1) return "YCbCr-4:4:4";
+    if (h0 == 2 * h1 && v0 == v1) return "YCbCr-4:2:2";
+    if (h0 == 2 * h1 && v0 == 2 * v1) return "YCbCr-4:2:0";
+    if (h0 == 4 * h1 && v0 == v1) return "YCbCr-4:1:1";
+    if (h0 == h1 && v0 == 2 * v1) return "YCbCr-4:4:0";
+    return NULL;
+}
+
+/* size and sampling from the SOF segment, sampling is NULL if not a YCbCr/gray layout */
+gboolean gst_es_jpeg_get_frame_info(
+    const guint8 *data, gsize size, gint *width, gint *height, const gchar **sampling) {
+    gsize offset = 2;
+    guint marker, len;
+
+    if (size < 4 || data[0] != 0xff || data[1] != JPEG_MARKER_SOI) {
+        return FALSE;
+    }
+    while (offset + 4 <= size) {
+        if (data[offset] != 0xff) {
+            offset++;
+            continue;
+        }
+        marker = data[offset + 1];
+        if (marker == 0xff || !marker || marker == JPEG_MARKER_TEM || IS_RST(marker)) {
+            offset += marker == 0xff ? 1 : 2;
+            continue;
+        }
+        // the frame header comes before the first scan
+        if (marker == JPEG_MARKER_SOS || marker == JPEG_MARKER_EOI) {
+            return FALSE;
+        }
+        len = GST_READ_UINT16_BE(data + offset + 2);
+        if (IS_SOF(marker)) {
+            // length, precision, height, width, component count, then 3 bytes per component
+            if (len < 8 || offset + 2 + len > size || len < 8 + 3 * (guint)data[offset + 9]) {
+                return FALSE;
+            }
+            *height = GST_READ_UINT16_BE(data + offset + 5);
+            *width = GST_READ_UINT16_BE(data + offset + 7);
+            if (sampling) {
+                *sampling = get_sampling(data + offset + 4, data[offset + 9]);
+            }
+            return *width > 0 && *height > 0;
+        }
+        offset += 2 + MAX(len, 2);
+    }
+    return FALSE;
+}
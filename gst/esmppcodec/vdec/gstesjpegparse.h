@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *     Author: Liujie <liujie@eswincomputing.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_ES_JPEG_PARSE_H__
+#define __GST_ES_JPEG_PARSE_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstadapter.h>
+
+/* marker walk state, kept between calls while the frame is incomplete */
+typedef struct {
+    gsize offset;       /* next byte to inspect, 0 to start at the SOI */
+    gboolean in_scan;   /* inside entropy coded data */
+    gsize header_size;  /* offset of the first SOS, kept once the frame is found */
+} GstEsJpegScan;
+
+gssize gst_es_jpeg_find_soi(GstAdapter *adapter);
+
+gboolean gst_es_jpeg_scan_frame(GstAdapter *adapter, GstEsJpegScan *scan, gsize *frame_size);
+
+gboolean gst_es_jpeg_get_frame_info(
+    const guint8 *data, gsize size, gint *width, gint *height, const gchar **sampling);
+
+#endif
@@ -24,6 +24,7 @@
 
 #include "gstesvideodec.h"
 #include "gstesdec_comm.h"
+#include "gstesh26xparse.h"
 
 #define GST_TYPE_ES_VIDEO_DEC (gst_es_video_dec_get_type())
 #define GST_ES_VIDEO_DEC(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_ES_VIDEO_DEC, GstEsVideoDec))
@@ -34,6 +35,11 @@ GST_DEBUG_CATEGORY(GST_CAT_DEFAULT);
 struct _GstEsVideoDec {
     GstEsDec parent;
     gint poll_timeout;
+    guint nal_length_size; /* 0 for byte-stream */
+    gint max_tid;          /* highest hevc temporal id of the sps, -1 until known */
+    gsize scan_offset;     /* next start code search of unaligned byte-stream, 0 before sync */
+    gboolean au_has_vcl;   /* the access unit being split holds a picture */
+    gboolean au_is_irap;
 };
 
 #define parent_class gst_es_video_dec_parent_class
@@ -51,7 +57,10 @@ static GstStaticPadTemplate gst_es_video_dec_sink_template =
                                             ";"));
 
 static GstStaticPadTemplate gst_es_video_dec_src_template = GST_STATIC_PAD_TEMPLATE(
-    "src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{" ES_DEC_FORMATS "}") ";"));
+    "src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS(GST_VIDEO_DMA_DRM_CAPS_MAKE ";" GST_VIDEO_CAPS_MAKE("{" ES_DEC_FORMATS "}") ";"));
 
 static MppCodingType get_mpp_coding_type(GstStructure *s) {
     if (gst_structure_has_name(s, "video/x-h264")) return MPP_VIDEO_CodingAVC;
@@ -59,8 +68,15 @@ static MppCodingType get_mpp_coding_type(GstStructure *s) {
     return MPP_VIDEO_CodingUnused;
 }
 
+static void reset_parse(GstEsVideoDec *self) {
+    self->scan_offset = 0;
+    self->au_has_vcl = FALSE;
+    self->au_is_irap = FALSE;
+}
+
 static gboolean gst_es_video_dec_set_format(GstVideoDecoder *decoder, GstVideoCodecState *state) {
     GstVideoDecoderClass *pclass = GST_VIDEO_DECODER_CLASS(parent_class);
+    GstEsVideoDec *self = GST_ES_VIDEO_DEC(decoder);
     GstEsDec *esdec = GST_ES_DEC(decoder);
     GstStructure *structure;
 
@@ -70,6 +86,19 @@ static gboolean gst_es_video_dec_set_format(GstVideoDecoder *decoder, GstVideoCo
         GST_ERROR_OBJECT(esdec, "esvideodec only support AVC and HEVC");
         return FALSE;
     }
+    self->nal_length_size =
+        gst_es_h26x_get_nal_length_size(gst_structure_get_string(structure, "stream-format"), state->codec_data);
+    self->max_tid = -1;
+    if (esdec->mpp_coding_type == MPP_VIDEO_CodingHEVC && self->nal_length_size) {
+        gst_es_h26x_get_hvcc_max_tid(state->codec_data, &self->max_tid);
+    }
+    // byte-stream not aligned on access units is split by the parse vfunc
+    gst_video_decoder_set_packetized(
+        decoder, self->nal_length_size || !g_strcmp0(gst_structure_get_string(structure, "alignment"), "au"));
+    reset_parse(self);
+    if (!esdec->input_state) {
+        gst_es_comm_dec_negotiate_format(esdec);
+    }
 
     // continue set format to esdec
     return pclass->set_format(decoder, state);
@@ -85,11 +114,12 @@ static gboolean gst_es_video_dec_set_extra_data(GstVideoDecoder *decoder) {
     return FALSE;
 }
 
-static MppPacketPtr gst_es_video_dec_prepare_mpp_packet(GstVideoDecoder *decoder, GstMapInfo *mapinfo) {
-    (void)(decoder);
-    MppPacketPtr mpp_packet = NULL;
-    mpp_packet_init(&mpp_packet, mapinfo->data, mapinfo->size);
-    return mpp_packet;
+static MppPacketPtr gst_es_video_dec_prepare_mpp_packet(GstVideoDecoder *decoder,
+                                                      GstBuffer *buffer,
+                                                      GstMapInfo *mapinfo,
+                                                      gboolean *imported) {
+    GstEsDec *esdec = GST_ES_DEC(decoder);
+    return gst_es_comm_dec_prepare_mpp_packet(esdec, buffer, mapinfo, imported);
 }
 
 static gint gst_es_video_dec_send_mpp_packet(GstVideoDecoder *decoder, MppPacketPtr mpp_packet, gint timeout_ms) {
@@ -108,6 +138,139 @@ static MppFramePtr gst_es_video_dec_get_mpp_frame(GstVideoDecoder *decoder, gint
     return mpp_frame;
 }
 
+static gboolean gst_es_video_dec_frame_is_droppable(GstVideoDecoder *decoder, GstVideoCodecFrame *frame) {
+    GstEsVideoDec *self = GST_ES_VIDEO_DEC(decoder);
+    GstEsDec *esdec = GST_ES_DEC(decoder);
+    GstMapInfo mapinfo;
+    gboolean droppable;
+
+    if (!gst_buffer_map(frame->input_buffer, &mapinfo, GST_MAP_READ)) {
+        return FALSE;
+    }
+    droppable = gst_es_h26x_is_droppable(mapinfo.data,
+                                         mapinfo.size,
+                                         self->nal_length_size,
+                                         esdec->mpp_coding_type == MPP_VIDEO_CodingHEVC,
+                                         self->max_tid);
+    gst_buffer_unmap(frame->input_buffer, &mapinfo);
+    return droppable;
+}
+
+static gboolean gst_es_video_dec_get_sequence_size(GstVideoDecoder *decoder,
+                                                   GstVideoCodecFrame *frame,
+                                                   gint *width,
+                                                   gint *height) {
+    GstEsVideoDec *self = GST_ES_VIDEO_DEC(decoder);
+    GstEsDec *esdec = GST_ES_DEC(decoder);
+    GstMapInfo mapinfo;
+    gboolean found;
+
+    if (esdec->mpp_coding_type != MPP_VIDEO_CodingAVC && esdec->mpp_coding_type != MPP_VIDEO_CodingHEVC) {
+        return FALSE;
+    }
+    // parameter sets come with key frames
+    if (GST_BUFFER_FLAG_IS_SET(frame->input_buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        return FALSE;
+    }
+    if (!gst_buffer_map(frame->input_buffer, &mapinfo, GST_MAP_READ)) {
+        return FALSE;
+    }
+    // the in-band sps also tells which pictures are never referenced
+    if (esdec->mpp_coding_type == MPP_VIDEO_CodingHEVC) {
+        gst_es_h26x_get_max_tid(mapinfo.data, mapinfo.size, self->nal_length_size, &self->max_tid);
+    }
+    found = gst_es_h26x_get_sps_size(mapinfo.data,
+                                     mapinfo.size,
+                                     self->nal_length_size,
+                                     esdec->mpp_coding_type == MPP_VIDEO_CodingHEVC,
+                                     width,
+                                     height);
+    gst_buffer_unmap(frame->input_buffer, &mapinfo);
+    return found;
+}
+
+/* Split unaligned byte-stream into access units. Start codes are searched in the adapter
+ * and only nal headers are copied out, an access unit spanning many input buffers is not
+ * merged before it is complete. */
+static GstFlowReturn gst_es_video_dec_parse(GstVideoDecoder *decoder,
+                                            GstVideoCodecFrame *frame,
+                                            GstAdapter *adapter,
+                                            gboolean at_eos) {
+    GstEsVideoDec *self = GST_ES_VIDEO_DEC(decoder);
+    GstEsDec *esdec = GST_ES_DEC(decoder);
+    gboolean is_hevc = esdec->mpp_coding_type == MPP_VIDEO_CodingHEVC;
+    gboolean starts_au, is_vcl, is_irap;
+    guint header_size = is_hevc ? 3 : 2;
+    guint8 header[3], byte;
+    gsize size, frame_size = 0;
+    gssize start = -1;
+
+    size = gst_adapter_available(adapter);
+    if (size < 4) {
+        goto need_data;
+    }
+    if (!self->scan_offset) {
+        start = gst_adapter_masked_scan_uint32(adapter, 0xffffff00, 0x00000100, 0, size);
+        if (start != 0) {
+            // keep the tail that may hold a partial start code
+            gst_adapter_flush(adapter, start > 0 ? (gsize)start : size - 3);
+            return GST_FLOW_OK;
+        }
+    }
+
+    while (self->scan_offset + 4 <= size) {
+        start = gst_adapter_masked_scan_uint32_peek(
+            adapter, 0xffffff00, 0x00000100, self->scan_offset, size - self->scan_offset, NULL);
+        if (start < 0) {
+            // positions before the last three bytes hold no start code
+            self->scan_offset = size - 3;
+            break;
+        }
+        // the nal header and the first bits of the slice header decide
+        if (start + 3 + header_size > size) {
+            break;
+        }
+        gst_adapter_copy(adapter, header, start + 3, header_size);
+        starts_au = gst_es_h26x_nal_starts_au(header, header_size, is_hevc, &is_vcl, &is_irap);
+        if (starts_au && self->au_has_vcl) {
+            // trailing zeros belong to the next start code
+            for (frame_size = start; frame_size; frame_size--) {
+                gst_adapter_copy(adapter, &byte, frame_size - 1, 1);
+                if (byte) break;
+            }
+            break;
+        }
+        self->au_has_vcl |= is_vcl;
+        self->au_is_irap |= is_irap;
+        self->scan_offset = start + 3;
+    }
+    if (!frame_size && at_eos && self->au_has_vcl) {
+        frame_size = size;
+    }
+    if (!frame_size) {
+        goto need_data;
+    }
+
+    if (self->au_is_irap) {
+        GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT(frame);
+    }
+    reset_parse(self);
+    gst_video_decoder_add_to_frame(decoder, frame_size);
+    return gst_video_decoder_have_frame(decoder);
+
+need_data:
+    if (at_eos) {
+        reset_parse(self);
+        gst_adapter_flush(adapter, size);
+    }
+    return GST_VIDEO_DECODER_FLOW_NEED_DATA;
+}
+
+static gboolean gst_es_video_dec_flush(GstVideoDecoder *decoder) {
+    reset_parse(GST_ES_VIDEO_DEC(decoder));
+    return GST_VIDEO_DECODER_CLASS(parent_class)->flush(decoder);
+}
+
 static gboolean gst_es_video_dec_shutdown(GstVideoDecoder *decoder, gboolean drain) {
     GstEsDec *esdec = GST_ES_DEC(decoder);
     return gst_es_comm_dec_shutdown(esdec, drain);
@@ -148,11 +311,15 @@ static void gst_es_video_dec_class_init(GstEsVideoDecClass *klass) {
     GST_DEBUG_CATEGORY_INIT(GST_CAT_DEFAULT, "esvideodec", 0, "ESWIN video decoder");
 
     decoder_class->set_format = GST_DEBUG_FUNCPTR(gst_es_video_dec_set_format);
+    decoder_class->parse = GST_DEBUG_FUNCPTR(gst_es_video_dec_parse);
+    decoder_class->flush = GST_DEBUG_FUNCPTR(gst_es_video_dec_flush);
     pclass->set_extra_data = GST_DEBUG_FUNCPTR(gst_es_video_dec_set_extra_data);
     pclass->prepare_mpp_packet = GST_DEBUG_FUNCPTR(gst_es_video_dec_prepare_mpp_packet);
     pclass->send_mpp_packet = GST_DEBUG_FUNCPTR(gst_es_video_dec_send_mpp_packet);
     pclass->get_mpp_frame = GST_DEBUG_FUNCPTR(gst_es_video_dec_get_mpp_frame);
     pclass->shutdown = GST_DEBUG_FUNCPTR(gst_es_video_dec_shutdown);
+    pclass->frame_is_droppable = GST_DEBUG_FUNCPTR(gst_es_video_dec_frame_is_droppable);
+    pclass->get_sequence_size = GST_DEBUG_FUNCPTR(gst_es_video_dec_get_sequence_size);
 
     gobject_class->set_property = GST_DEBUG_FUNCPTR(gst_es_video_dec_set_property);
     gobject_class->get_property = GST_DEBUG_FUNCPTR(gst_es_video_dec_get_property);
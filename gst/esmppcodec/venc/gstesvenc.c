@@ -27,6 +27,7 @@
 #include <es_mpp_cmd.h>
 #include "gstesvenc.h"
 #include "gstesallocator.h"
+#include "gstesbufferpool.h"
 #include "gstesh264enc.h"
 #include "gstesjpegenc.h"
 
@@ -61,6 +62,9 @@ G_DEFINE_ABSTRACT_TYPE(GstEsVenc, gst_es_venc, GST_TYPE_VIDEO_ENCODER);
 
 #define GST_ES_VENC_UNLOCK(encoder) g_mutex_unlock(GST_ES_VENC_MUTEX(encoder));
 #define MPP_PENDING_MAX 6 /* Max number of MPP pending frame */
+#define WATCHDOG_MS 5000  /* Default ms without output before the context is reset */
+#define OUTPUT_QUEUE_MAX 32
+#define FETCH_TIMEOUT_MS 100 /* Max ms the fetch thread blocks in mpp before checking for a stop */
 #define H26X_HEADER_SIZE 1024
 
 enum {
@@ -97,6 +101,8 @@ enum {
     VUI_COLOR_SPACE,
     VUI_COLOR_PRIMARIES,
     VUI_COLOR_TRC,
+    PROP_WATCHDOG,
+    PROP_OUTPUT_QUEUE_SIZE,
 };
 
 gboolean gst_es_venc_supported(MppCodingType coding) {
@@ -137,6 +143,9 @@ static gboolean gst_es_venc_start(GstVideoEncoder *encoder) {
     self->draining = FALSE;
     self->prop_dirty = FALSE;
     self->eos = FALSE;
+    self->stalled = FALSE;
+    self->fetch_thread = NULL;
+    g_queue_init(&self->out_queue);
 
     g_mutex_init(&self->mutex);
     g_mutex_init(&self->event_mutex);
@@ -151,12 +160,120 @@ err_unref_alloc:
     return FALSE;
 }
 
+/* Drain encoded packets into the output queue, so that the hardware keeps
+ * encoding while the src pad task is blocked downstream.
+ */
+static gpointer gst_es_venc_fetch_loop(gpointer data) {
+    GstEsVenc *self = GST_ES_VENC(data);
+    MppPacketPtr mpkt;
+    gint64 end_time;
+    gint ret;
+
+    g_mutex_lock(GST_ES_VENC_EVENT_MUTEX(self));
+    while (self->fetching) {
+        if (g_queue_get_length(&self->out_queue) >= (guint)self->output_queue_size) {
+            g_cond_wait(GST_ES_VENC_EVENT_COND(self), GST_ES_VENC_EVENT_MUTEX(self));
+            continue;
+        }
+        g_mutex_unlock(GST_ES_VENC_EVENT_MUTEX(self));
+        mpkt = NULL;
+        // blocks until a packet is encoded
+        ret = esmpp_get_packet(self->ctx, &mpkt, FETCH_TIMEOUT_MS);
+        g_mutex_lock(GST_ES_VENC_EVENT_MUTEX(self));
+        if (mpkt) {
+            g_queue_push_tail(&self->out_queue, mpkt);
+            g_cond_broadcast(GST_ES_VENC_EVENT_COND(self));
+        } else if (ret != MPP_OK && ret != MPP_ERR_TIMEOUT && self->fetching) {
+            // do not spin on a failing context, a stop request still wakes us up
+            end_time = g_get_monotonic_time() + FETCH_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+            g_cond_wait_until(GST_ES_VENC_EVENT_COND(self), GST_ES_VENC_EVENT_MUTEX(self), end_time);
+        }
+    }
+    g_mutex_unlock(GST_ES_VENC_EVENT_MUTEX(self));
+    return NULL;
+}
+
+static void gst_es_venc_start_fetch_thread(GstEsVenc *self) {
+    if (!self->output_queue_size || self->fetch_thread) {
+        return;
+    }
+    self->fetching = TRUE;
+    self->fetch_thread = g_thread_new("esvenc-fetch", gst_es_venc_fetch_loop, self);
+}
+
+/* Stop fetching before the src pad task is stopped, so that only the task
+ * reads mpp from then on. Packets already queued are still handed out first.
+ */
+static void gst_es_venc_stop_fetch_thread(GstEsVenc *self) {
+    if (!self->fetch_thread) {
+        return;
+    }
+    g_mutex_lock(GST_ES_VENC_EVENT_MUTEX(self));
+    self->fetching = FALSE;
+    g_cond_broadcast(GST_ES_VENC_EVENT_COND(self));
+    g_mutex_unlock(GST_ES_VENC_EVENT_MUTEX(self));
+    g_thread_join(self->fetch_thread);
+
+    g_mutex_lock(GST_ES_VENC_EVENT_MUTEX(self));
+    self->fetch_thread = NULL;
+    // the pad task may wait for the queue
+    g_cond_broadcast(GST_ES_VENC_EVENT_COND(self));
+    g_mutex_unlock(GST_ES_VENC_EVENT_MUTEX(self));
+}
+
+/* the src pad task is stopped, queued packets are dropped with their frames */
+static void gst_es_venc_drop_queued_packets(GstEsVenc *self) {
+    MppFramePtr input_mpp_frame;
+    MppMetaPtr meta;
+    MppPacketPtr mpkt;
+
+    while ((mpkt = g_queue_pop_head(&self->out_queue))) {
+        input_mpp_frame = NULL;
+        meta = mpp_packet_has_meta(mpkt) ? mpp_packet_get_meta(mpkt) : NULL;
+        if (meta) {
+            mpp_meta_get_frame(meta, KEY_INPUT_FRAME, &input_mpp_frame);
+        }
+        if (input_mpp_frame) {
+            mpp_frame_deinit(&input_mpp_frame);
+        }
+        mpp_packet_deinit(&mpkt);
+    }
+}
+
+/* Next encoded packet, taken from the fetch thread when there is one. Packets
+ * it queued come first, mpp is only read once the thread has been joined.
+ */
+static gint gst_es_venc_get_packet(GstEsVenc *self, MppPacketPtr *mpkt) {
+    gint64 end_time;
+    gboolean queued;
+
+    end_time = g_get_monotonic_time() + 10 * G_TIME_SPAN_MILLISECOND;
+    g_mutex_lock(GST_ES_VENC_EVENT_MUTEX(self));
+    while (g_queue_is_empty(&self->out_queue) && self->fetch_thread) {
+        if (!g_cond_wait_until(GST_ES_VENC_EVENT_COND(self), GST_ES_VENC_EVENT_MUTEX(self), end_time)) {
+            break;
+        }
+    }
+    *mpkt = g_queue_pop_head(&self->out_queue);
+    queued = *mpkt || self->fetch_thread;
+    // a fetch thread blocked on a full queue goes on
+    g_cond_broadcast(GST_ES_VENC_EVENT_COND(self));
+    g_mutex_unlock(GST_ES_VENC_EVENT_MUTEX(self));
+
+    if (!queued) {
+        return esmpp_get_packet(self->ctx, mpkt, 0);
+    }
+    return *mpkt ? MPP_OK : MPP_ERR_TIMEOUT;
+}
+
 static gboolean gst_es_venc_stop(GstVideoEncoder *encoder) {
     GstEsVenc *self = GST_ES_VENC(encoder);
 
     GST_DEBUG_OBJECT(self, "stopping es encoder, type=%d", self->mpp_type);
 
     GST_VIDEO_ENCODER_STREAM_LOCK(encoder);
+    gst_es_venc_stop_fetch_thread(self);
+    gst_es_venc_drop_queued_packets(self);
 
     if (self->extradata) {
         g_free(self->extradata);
@@ -240,7 +357,10 @@ static void gst_es_venc_reset(GstVideoEncoder *encoder, gboolean drain, gboolean
     self->flushing = TRUE;
     self->draining = drain;
 
+    // the task drains what the fetch thread queued, then reads mpp alone
+    gst_es_venc_stop_fetch_thread(self);
     gst_es_venc_stop_task(encoder, drain);
+    gst_es_venc_drop_queued_packets(self);
 
     self->flushing = final;
     self->draining = FALSE;
@@ -248,6 +368,7 @@ static void gst_es_venc_reset(GstVideoEncoder *encoder, gboolean drain, gboolean
     // self->mpi->reset (self->mpp_ctx);
     self->task_ret = GST_FLOW_OK;
     self->pending_frames = 0;
+    self->stalled = FALSE;
 
     /* Force re-apply prop */
     self->prop_dirty = TRUE;
@@ -395,7 +516,7 @@ gboolean gst_es_venc_set_format(GstVideoEncoder *encoder, GstVideoCodecState *st
 
     self->input_state = gst_video_codec_state_ref(state);
     *info = state->info;
-    if (!gst_es_venc_video_info_align(info)) {
+    if (!gst_es_venc_video_info_align(info, params->stride_align)) {
         return FALSE;
     }
 
@@ -443,6 +564,17 @@ void gst_es_venc_set_property(GObject *object, guint prop_id, const GValue *valu
     GstEsVencParam *params = &self->params;
 
     switch (prop_id) {
+        case PROP_WATCHDOG:
+            // not an encoder parameter, nothing to re-apply
+            self->watchdog = g_value_get_int(value);
+            return;
+        case PROP_OUTPUT_QUEUE_SIZE:
+            // input buffers are proposed for the queue on the next allocation query
+            if (self->input_state)
+                GST_WARNING_OBJECT(encoder, "unable to change output queue size");
+            else
+                self->output_queue_size = g_value_get_int(value);
+            return;
         case PROP_STRIDE_ALIGN: {
             gint align = g_value_get_int(value);
             if (!IsPower(align)) {
@@ -596,6 +728,12 @@ void gst_es_venc_get_property(GObject *object, guint prop_id, GValue *value, GPa
     GstEsVencParam *params = &self->params;
 
     switch (prop_id) {
+        case PROP_OUTPUT_QUEUE_SIZE:
+            g_value_set_int(value, self->output_queue_size);
+            break;
+        case PROP_WATCHDOG:
+            g_value_set_int(value, self->watchdog);
+            break;
         case PROP_STRIDE_ALIGN:
             g_value_set_int(value, params->stride_align);
             break;
@@ -840,18 +978,23 @@ static GType gst_es_venc_color_primaries_get_type(void) {
     return color_primaries;
 }
 
-gboolean gst_es_venc_video_info_align(GstVideoInfo *info) {
+gboolean gst_es_venc_video_info_align(GstVideoInfo *info, gint stride_align) {
     gint vstride = 0;
     gint hstride = 0;
 
+    stride_align = MAX(stride_align, 0);
     /* Allow vstride aligning */
     if (!g_getenv("GST_ES_VENC_ALIGNED_VSTRIDE")) {
         vstride = GST_ES_VIDEO_INFO_VSTRIDE(info);
     }
     if (!g_getenv("GST_ES_VENC_ALIGNED_HSTRIDE")) {
         hstride = GST_ES_VIDEO_INFO_HSTRIDE(info);
+        // the stride programmed into the encoder follows stride-align
+        if (stride_align) {
+            hstride = GST_ES_ALIGN_N(hstride, stride_align);
+        }
     }
-    return gst_es_video_info_align(info, hstride, vstride);
+    return gst_es_video_info_align(info, hstride, vstride, stride_align);
 }
 
 static gboolean gst_es_venc_propose_allocation(GstVideoEncoder *encoder, GstQuery *query) {
@@ -861,7 +1004,8 @@ static gboolean gst_es_venc_propose_allocation(GstVideoEncoder *encoder, GstQuer
     GstBufferPool *pool;
     GstVideoInfo info;
     GstCaps *caps;
-    guint size;
+    gchar name[16];
+    guint size, i;
 
     GST_DEBUG_OBJECT(self, "propose allocation");
 
@@ -876,12 +1020,10 @@ static gboolean gst_es_venc_propose_allocation(GstVideoEncoder *encoder, GstQuer
         return FALSE;
     }
 
-    gst_es_venc_video_info_align(&info);
+    gst_es_venc_video_info_align(&info, self->params.stride_align);
     size = GST_VIDEO_INFO_SIZE(&info);
 
-    gst_video_alignment_reset(&align);
-    align.padding_right = gst_es_get_pixel_stride(&info) - GST_VIDEO_INFO_WIDTH(&info);
-    align.padding_bottom = GST_ES_VIDEO_INFO_VSTRIDE(&info) - GST_VIDEO_INFO_HEIGHT(&info);
+    gst_es_video_alignment_from_info(&align, &info, MAX(self->params.stride_align, 0));
 
     GST_DEBUG_OBJECT(self,
                      "propose allocation top:%d, b:%d, l:%d, r:%d\n",
@@ -904,10 +1046,14 @@ static gboolean gst_es_venc_propose_allocation(GstVideoEncoder *encoder, GstQuer
                                G_TYPE_UINT,
                                align.padding_right,
                                NULL);
+    for (i = 0; i < GST_VIDEO_INFO_N_PLANES(&info); i++) {
+        g_snprintf(name, sizeof(name), "stride-align%u", i);
+        gst_structure_set(params, name, G_TYPE_UINT, align.stride_align[i], NULL);
+    }
     gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, params);
     gst_structure_free(params);
 
-    pool = gst_video_buffer_pool_new();
+    pool = gst_es_buffer_pool_new();
 
     config = gst_buffer_pool_get_config(pool);
     gst_buffer_pool_config_set_params(config, caps, size, 0, 0);
@@ -919,7 +1065,7 @@ static gboolean gst_es_venc_propose_allocation(GstVideoEncoder *encoder, GstQuer
 
     gst_buffer_pool_set_config(pool, config);
 
-    gst_query_add_allocation_pool(query, pool, size, MPP_PENDING_MAX, 0);
+    gst_query_add_allocation_pool(query, pool, size, MPP_PENDING_MAX + self->output_queue_size, 0);
     gst_query_add_allocation_param(query, self->allocator, NULL);
 
     gst_object_unref(pool);
@@ -958,6 +1104,38 @@ static gboolean gst_es_venc_video_info_matched(GstVideoInfo *info, GstVideoInfo
     return TRUE;
 }
 
+/* Take over an upstream layout the encoder can read as is, so frames from a
+ * differently aligned producer are imported instead of copied.
+ */
+static gboolean gst_es_venc_adopt_layout(GstEsVenc *self, GstVideoInfo *src_info, gsize size) {
+    GstVideoInfo info = self->input_state->info;
+    gint stride_align = self->params.stride_align;
+    gint hstride = GST_ES_VIDEO_INFO_HSTRIDE(src_info);
+    guint i;
+
+    if (hstride <= 0 || (stride_align > 0 && hstride % stride_align)) {
+        return FALSE;
+    }
+    if (!gst_es_video_info_align(&info, hstride, GST_ES_VIDEO_INFO_VSTRIDE(src_info), 0)) {
+        return FALSE;
+    }
+    // only planes packed one after the other at the same stride can be described to mpp
+    for (i = 0; i < GST_VIDEO_INFO_N_PLANES(&info); i++) {
+        if (GST_VIDEO_INFO_PLANE_STRIDE(&info, i) != GST_VIDEO_INFO_PLANE_STRIDE(src_info, i)
+            || GST_VIDEO_INFO_PLANE_OFFSET(&info, i) != GST_VIDEO_INFO_PLANE_OFFSET(src_info, i)) {
+            return FALSE;
+        }
+    }
+    if (size < GST_VIDEO_INFO_SIZE(&info)) {
+        return FALSE;
+    }
+
+    GST_INFO_OBJECT(self, "adopting upstream stride %d, was %d", hstride, GST_ES_VIDEO_INFO_HSTRIDE(&self->info));
+    self->info = info;
+    GST_VIDEO_INFO_SIZE(src_info) = GST_VIDEO_INFO_SIZE(&info);
+    return TRUE;
+}
+
 /** convert frame to hw dma buffer frame.
  *  1 hw dma buffer;
  *  2 alloc a hw dma and copy data from vir addr.
@@ -985,6 +1163,9 @@ static GstBuffer *gst_es_venc_convert(GstVideoEncoder *encoder, GstVideoCodecFra
     }
 
     size = gst_buffer_get_sizes(inbuf, &offset, &maxsize);
+    if (meta && !gst_es_venc_video_info_matched(&src_info, dst_info)) {
+        gst_es_venc_adopt_layout(self, &src_info, size);
+    }
     if (size < GST_VIDEO_INFO_SIZE(&src_info)) {
         GST_ERROR_OBJECT(self,
                          "input buffer too small (%" G_GSIZE_FORMAT " < %" G_GSIZE_FORMAT ")",
@@ -1020,6 +1201,13 @@ static GstBuffer *gst_es_venc_convert(GstVideoEncoder *encoder, GstVideoCodecFra
 
     // If input buffer is hw dma buffer, peek it to out_mem
     in_mem = gst_buffer_peek_memory(inbuf, 0);
+    if (in_mem->allocator == self->allocator) {
+        // memory from our own pool already carries its mpp buffer, no need to import it again
+        gst_buffer_append_memory(outbuf, gst_memory_ref(in_mem));
+        GST_DEBUG_OBJECT(self, "using pooled buffer");
+        return outbuf;
+    }
+
     out_mem = gst_es_allocator_import_gst_memory(self->allocator, in_mem);
     if (!out_mem) {
         goto convert;
@@ -1083,7 +1271,7 @@ static void flush_EOS_pkts(GstVideoEncoder *encoder) {
     MppFramePtr input_mpp_frame = NULL;
     MppBufferPtr out_mpp_buf = NULL;
 
-    esmpp_get_packet(self->ctx, &mpkt, 0);
+    gst_es_venc_get_packet(self, &mpkt);
     if (mpkt) {
         eos = mpp_packet_get_eos(mpkt);
         if (eos) {
@@ -1123,6 +1311,14 @@ static void flush_EOS_pkts(GstVideoEncoder *encoder) {
     return;
 }
 
+/* frames are pending but mpp returned no packet for the whole watchdog budget */
+static gboolean gst_es_venc_output_stalled(GstEsVenc *self) {
+    if (!self->watchdog || !self->pending_frames) {
+        return FALSE;
+    }
+    return g_get_monotonic_time() - self->last_output >= (gint64)self->watchdog * G_TIME_SPAN_MILLISECOND;
+}
+
 static void gst_es_venc_loop(GstVideoEncoder *encoder) {
     GstEsVenc *self = GST_ES_VENC(encoder);
     GstVideoCodecFrame *gst_frame = NULL;
@@ -1142,11 +1338,22 @@ static void gst_es_venc_loop(GstVideoEncoder *encoder) {
     }
     GST_VIDEO_ENCODER_STREAM_UNLOCK(encoder);
 
-    ret = esmpp_get_packet(self->ctx, &mpkt, 0);
+    ret = gst_es_venc_get_packet(self, &mpkt);
     if (ret == MPP_ERR_TIMEOUT) {
-        g_usleep(10 * 1000);
+        // the fetch thread already waited for a packet
+        if (!self->fetch_thread) {
+            g_usleep(10 * 1000);
+        }
+        GST_VIDEO_ENCODER_STREAM_LOCK(encoder);
+        if (!self->stalled && gst_es_venc_output_stalled(self)) {
+            GST_WARNING_OBJECT(self, "no output for %u frames, hardware stalled", self->pending_frames);
+            self->stalled = TRUE;
+            // wake up the input side waiting for a free slot
+            GST_ES_VENC_BROADCAST(encoder);
+        }
     } else if (ret != MPP_OK) {
         GST_ERROR_OBJECT(self, "get packet failed! ret = %d\n", ret);
+        GST_VIDEO_ENCODER_STREAM_LOCK(encoder);
     } else if (ret == MPP_OK) {
         GstBuffer *buffer = NULL;
         GstMemory *output_gst_mem = NULL;
@@ -1250,6 +1457,8 @@ static void gst_es_venc_loop(GstVideoEncoder *encoder) {
             mpp_packet_deinit(&mpkt);
             mpkt = NULL;
         }
+        // counted after pushing, time blocked downstream is no stall
+        self->last_output = g_get_monotonic_time();
     }
 
 out:
@@ -1289,9 +1498,38 @@ drop:
     GST_DEBUG_OBJECT(self, "drop gst frame");
     gst_buffer_replace(&gst_frame->output_buffer, NULL);
     gst_video_encoder_finish_frame(encoder, gst_frame);
+    self->last_output = g_get_monotonic_time();
     goto out;
 }
 
+/* Reset a stalled context in place, encoding resumes with a key frame */
+static void gst_es_venc_recover_stall(GstVideoEncoder *encoder, GstVideoCodecFrame *frame) {
+    GstEsVenc *self = GST_ES_VENC(encoder);
+    GList *frames, *l;
+
+    GST_ELEMENT_WARNING(self,
+                        STREAM,
+                        ENCODE,
+                        ("Encoder stalled, resetting it"),
+                        ("no output for %d ms with %u frames pending", self->watchdog, self->pending_frames));
+    gst_es_venc_reset(encoder, FALSE, FALSE);
+    esmpp_reset(self->ctx);
+
+    // frames queued in the stalled context never come back
+    frames = gst_video_encoder_get_frames(encoder);
+    for (l = frames; l; l = l->next) {
+        GstVideoCodecFrame *pending = l->data;
+        if (pending == frame) {
+            continue;
+        }
+        gst_buffer_replace(&pending->output_buffer, NULL);
+        gst_video_encoder_finish_frame(encoder, gst_video_codec_frame_ref(pending));
+    }
+    g_list_free_full(frames, (GDestroyNotify)gst_video_codec_frame_unref);
+
+    GST_VIDEO_CODEC_FRAME_SET_FORCE_KEYFRAME(frame);
+}
+
 static GstFlowReturn gst_es_venc_handle_frame(GstVideoEncoder *encoder, GstVideoCodecFrame *frame) {
     GstEsVenc *self = GST_ES_VENC(encoder);
     GstBuffer *buffer;
@@ -1303,10 +1541,11 @@ static GstFlowReturn gst_es_venc_handle_frame(GstVideoEncoder *encoder, GstVideo
     gboolean keyframe;
     GstFlowReturn ret = GST_FLOW_OK;
     gint dump_input = 0;
-    GstVideoInfo *src_info = &self->input_state->info;
     guint stride[4] = {0}, offsets[4] = {0};
+    gboolean recovered = FALSE;
 
     GST_DEBUG_OBJECT(self, "handling frame[%d]", frame->system_frame_number);
+retry:
     GST_ES_VENC_LOCK(encoder);
     if (G_UNLIKELY(self->flushing)) {
         goto flushing;
@@ -1314,6 +1553,8 @@ static GstFlowReturn gst_es_venc_handle_frame(GstVideoEncoder *encoder, GstVideo
 
     if (G_UNLIKELY(!GST_ES_VENC_TASK_STARTED(encoder))) {
         GST_DEBUG_OBJECT(self, "starting encoding thread");
+        self->last_output = g_get_monotonic_time();
+        gst_es_venc_start_fetch_thread(self);
         gst_pad_start_task(encoder->srcpad, (GstTaskFunction)gst_es_venc_loop, encoder, NULL);
     }
 
@@ -1342,13 +1583,14 @@ static GstFlowReturn gst_es_venc_handle_frame(GstVideoEncoder *encoder, GstVideo
         GST_ERROR_OBJECT(self, "get_mpp_buffer_from_gst_mem failed\n");
         goto drop;
     }
-    for (gint i = 0; i < GST_VIDEO_INFO_N_PLANES(src_info); i++) {
-        stride[i] = GST_VIDEO_INFO_PLANE_STRIDE(src_info, i);
-        offsets[i] = GST_VIDEO_INFO_PLANE_OFFSET(src_info, i);
+    // converted buffers always carry the layout of self->info
+    for (gint i = 0; i < GST_VIDEO_INFO_N_PLANES(info); i++) {
+        stride[i] = GST_VIDEO_INFO_PLANE_STRIDE(info, i);
+        offsets[i] = GST_VIDEO_INFO_PLANE_OFFSET(info, i);
     }
     GST_DEBUG_OBJECT(self,
                      "frame planes:%d, stride:%d,%d,%d, offset:%d,%d,%d\n",
-                     GST_VIDEO_INFO_N_PLANES(src_info),
+                     GST_VIDEO_INFO_N_PLANES(info),
                      stride[0],
                      stride[1],
                      stride[2],
@@ -1398,12 +1640,22 @@ static GstFlowReturn gst_es_venc_handle_frame(GstVideoEncoder *encoder, GstVideo
 
     /* Avoid holding too much frames */
     GST_VIDEO_ENCODER_STREAM_UNLOCK(encoder);
-    GST_ES_VENC_WAIT(encoder, self->pending_frames < MPP_PENDING_MAX || self->flushing);
+    // queued packets still hold their input frames
+    GST_ES_VENC_WAIT(encoder,
+                     self->pending_frames < MPP_PENDING_MAX + (guint)self->output_queue_size || self->flushing
+                         || self->stalled);
     GST_VIDEO_ENCODER_STREAM_LOCK(encoder);
+    if (G_UNLIKELY(self->stalled)) {
+        goto stalled;
+    }
 
 send_frame:
     gint val = esmpp_put_frame(self->ctx, mpp_frame);
     if (MPP_ERR_INPUT_FULL == val) {
+        if (gst_es_venc_output_stalled(self)) {
+            self->stalled = TRUE;
+            goto stalled;
+        }
         g_usleep(10 * 1000);
         goto send_frame;
     } else if (MPP_OK != val) {
@@ -1413,6 +1665,10 @@ send_frame:
     }
 
     frame->output_buffer = buffer;
+    if (!self->pending_frames) {
+        // the watchdog budget starts with the first frame mpp holds
+        self->last_output = g_get_monotonic_time();
+    }
     self->pending_frames++;
     GST_ES_VENC_BROADCAST(encoder);
     GST_ES_VENC_UNLOCK(encoder);
@@ -1422,6 +1678,20 @@ flushing:
     GST_WARNING_OBJECT(self, "flushing");
     ret = GST_FLOW_FLUSHING;
     goto drop;
+stalled:
+    if (recovered) {
+        GST_ELEMENT_ERROR(self, STREAM, ENCODE, ("Encoder stalled again after a reset"), (NULL));
+        ret = GST_FLOW_ERROR;
+        goto drop;
+    }
+    mpp_frame_deinit(&mpp_frame);
+    gst_buffer_unref(buffer);
+    in_mpp_buf = NULL;
+    GST_ES_VENC_UNLOCK(encoder);
+    gst_es_venc_recover_stall(encoder, frame);
+    // encode this frame once more on the fresh context
+    recovered = TRUE;
+    goto retry;
 not_negotiated:
     GST_ERROR_OBJECT(self, "not negotiated");
     ret = GST_FLOW_NOT_NEGOTIATED;
@@ -1770,11 +2040,34 @@ static void gst_es_venc_class_init(GstEsVencClass *klass) {
                                                       GST_TYPE_ES_VENC_COLOR_TRC,
                                                       MPP_FRAME_TRC_SMPTE170M,
                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_WATCHDOG,
+                                    g_param_spec_int("watchdog",
+                                                     "watchdog",
+                                                     "Milliseconds without output while frames are pending before "
+                                                     "the encoder is reset in place, 0-disable",
+                                                     0,
+                                                     G_MAXINT,
+                                                     WATCHDOG_MS,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property(gobject_class,
+                                    PROP_OUTPUT_QUEUE_SIZE,
+                                    g_param_spec_int("output-queue-size",
+                                                     "output-queue-size",
+                                                     "Packets fetched from the hardware ahead of downstream by a "
+                                                     "separate thread, 0-fetch and push on one thread",
+                                                     0,
+                                                     OUTPUT_QUEUE_MAX,
+                                                     0,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 static void gst_es_venc_init(GstEsVenc *self) {
     GstEsVencParam *params = &self->params;
     self->mpp_type = MPP_VIDEO_CodingUnused;
+    self->watchdog = WATCHDOG_MS;
 
     gst_es_venc_cfg_set_default(params);
 }
@@ -60,6 +60,15 @@ struct _GstEsVenc {
     gboolean zero_copy_pkt;
     gboolean eos;
 
+    gint watchdog;       /* ms without output while frames are pending before a reset, 0 disables */
+    gint64 last_output;  /* monotonic time the last packet was handled */
+    gboolean stalled;    /* watchdog fired, recover on the blocked or next input frame */
+
+    gint output_queue_size; /* packets fetched ahead of downstream by fetch_thread, 0 fetches from the pad task */
+    GThread *fetch_thread;
+    gboolean fetching; /* under event_mutex, the fetch thread keeps running */
+    GQueue out_queue;  /* under event_mutex, MppPacketPtr fetched but not pushed */
+
     guint *extradata;
     gint extradata_size;
 
@@ -79,7 +88,7 @@ struct _GstEsVenc {
 #define ES_VENC_SUPPORT_FORMATS "NV12, NV21, I420, YV12, YUY2, UYVY, I420_10LE, P010_10LE"
 
 gboolean gst_es_venc_supported(MppCodingType coding);
-gboolean gst_es_venc_video_info_align(GstVideoInfo *info);
+gboolean gst_es_venc_video_info_align(GstVideoInfo *info, gint stride_align);
 
 gboolean gst_es_venc_set_format(GstVideoEncoder *encoder, GstVideoCodecState *state);
 void gst_es_venc_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <gst/check/gstcheck.h>
+#include "gstesh26xparse.h"
+
+/* nal header bytes with the result expected from gst_es_h26x_nal_starts_au */
+typedef struct {
+    guint8 header[3];
+    gboolean starts_au;
+    gboolean is_vcl;
+    gboolean is_irap;
+} NalCase;
+
+static void check_nal_cases(const NalCase *cases, guint n, gboolean is_hevc) {
+    gboolean starts_au, is_vcl, is_irap;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        starts_au = gst_es_h26x_nal_starts_au(cases[i].header, is_hevc ? 3 : 2, is_hevc, &is_vcl, &is_irap);
+        fail_unless_equals_int(starts_au, cases[i].starts_au);
+        fail_unless_equals_int(is_vcl, cases[i].is_vcl);
+        fail_unless_equals_int(is_irap, cases[i].is_irap);
+    }
+}
+
+GST_START_TEST(test_start_code_sizes) {
+    const guint8 three[] = {0x00, 0x00, 0x01, 0x65, 0x88};
+    const guint8 four[] = {0x00, 0x00, 0x00, 0x01, 0x65, 0x88};
+    const guint8 mixed[] = {0x00, 0x01, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x01, 0x41};
+
+    fail_unless_equals_int(gst_es_h26x_find_start_code(three, sizeof(three), 0), 0);
+    // the leading zero of a 4 byte start code is left to the previous nal
+    fail_unless_equals_int(gst_es_h26x_find_start_code(four, sizeof(four), 0), 1);
+    fail_unless_equals_int(gst_es_h26x_find_start_code(mixed, sizeof(mixed), 0), 6);
+    fail_unless_equals_int(gst_es_h26x_find_start_code(mixed, sizeof(mixed), 7), -1);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_start_code_edges) {
+    const guint8 partial[] = {0x55, 0x55, 0x00, 0x00};
+    const guint8 last[] = {0x55, 0x00, 0x00, 0x01};
+    guint8 data[64];
+    guint pos;
+
+    fail_unless_equals_int(gst_es_h26x_find_start_code(partial, sizeof(partial), 0), -1);
+    fail_unless_equals_int(gst_es_h26x_find_start_code(last, sizeof(last), 0), 1);
+    fail_unless_equals_int(gst_es_h26x_find_start_code(last, 3, 0), -1);
+
+    // every position, across the words skipped without a zero byte
+    for (pos = 0; pos + 3 <= sizeof(data); pos++) {
+        memset(data, 0x55, sizeof(data));
+        data[pos] = 0x00;
+        data[pos + 1] = 0x00;
+        data[pos + 2] = 0x01;
+        fail_unless_equals_int(gst_es_h26x_find_start_code(data, sizeof(data), 0), pos);
+        fail_unless_equals_int(gst_es_h26x_find_start_code(data, sizeof(data), pos + 1), -1);
+        // cut inside the start code
+        fail_unless_equals_int(gst_es_h26x_find_start_code(data, pos + 2, 0), -1);
+    }
+}
+GST_END_TEST;
+
+GST_START_TEST(test_trailing_zeros) {
+    const guint8 data[] = {0x00, 0x00, 0x01, 0x41, 0x9a, 0x00, 0x00, 0x00, 0x00,
+                           0x00, 0x01, 0x41, 0x9a, 0x00, 0x00, 0x00, 0x01, 0x09};
+    const guint8 *nal;
+    gsize nal_size, offset = 0;
+
+    fail_unless(gst_es_h26x_next_nal(data, sizeof(data), 0, &offset, &nal, &nal_size));
+    fail_unless_equals_int(nal - data, 3);
+    fail_unless_equals_int(nal_size, 2);
+
+    fail_unless(gst_es_h26x_next_nal(data, sizeof(data), 0, &offset, &nal, &nal_size));
+    fail_unless_equals_int(nal - data, 11);
+    fail_unless_equals_int(nal_size, 2);
+
+    // the last nal runs to the end of the data
+    fail_unless(gst_es_h26x_next_nal(data, sizeof(data), 0, &offset, &nal, &nal_size));
+    fail_unless_equals_int(nal - data, 17);
+    fail_unless_equals_int(nal_size, 1);
+    fail_if(gst_es_h26x_next_nal(data, sizeof(data), 0, &offset, &nal, &nal_size));
+}
+GST_END_TEST;
+
+GST_START_TEST(test_h264_au_boundaries) {
+    const NalCase cases[] = {
+        {{0x09, 0xf0}, TRUE, FALSE, FALSE},  // aud
+        {{0x67, 0x42}, TRUE, FALSE, FALSE},  // sps
+        {{0x68, 0xce}, TRUE, FALSE, FALSE},  // pps
+        {{0x06, 0x05}, TRUE, FALSE, FALSE},  // sei
+        {{0x65, 0x88}, TRUE, TRUE, TRUE},    // idr, first_mb_in_slice 0
+        {{0x65, 0x12}, FALSE, TRUE, TRUE},   // idr, next slice of the picture
+        {{0x41, 0x9a}, TRUE, TRUE, FALSE},   // non idr, first_mb_in_slice 0
+        {{0x01, 0x20}, FALSE, TRUE, FALSE},  // non reference, next slice
+        {{0x0c, 0xff}, FALSE, FALSE, FALSE}, // filler
+    };
+
+    check_nal_cases(cases, G_N_ELEMENTS(cases), FALSE);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_h265_au_boundaries) {
+    const NalCase cases[] = {
+        {{0x40, 0x01, 0x0c}, TRUE, FALSE, FALSE},  // vps
+        {{0x42, 0x01, 0x01}, TRUE, FALSE, FALSE},  // sps
+        {{0x44, 0x01, 0xc1}, TRUE, FALSE, FALSE},  // pps
+        {{0x4e, 0x01, 0x05}, TRUE, FALSE, FALSE},  // prefix sei
+        {{0x26, 0x01, 0xaf}, TRUE, TRUE, TRUE},    // idr_w_radl, first_slice_segment_in_pic_flag
+        {{0x26, 0x01, 0x2f}, FALSE, TRUE, TRUE},   // idr_w_radl, next slice segment
+        {{0x50, 0x01, 0x05}, FALSE, FALSE, FALSE}, // suffix sei
+        {{0x2a, 0x01, 0xaf}, TRUE, TRUE, TRUE},    // cra
+        {{0x02, 0x01, 0xd0}, TRUE, TRUE, FALSE},   // trail_r
+        {{0x00, 0x03, 0x50}, FALSE, TRUE, FALSE},  // trail_n of sub-layer 2, next slice segment
+    };
+
+    check_nal_cases(cases, G_N_ELEMENTS(cases), TRUE);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_h265_droppable) {
+    const guint8 sps[] = {0x00, 0x00, 0x01, 0x42, 0x01, 0x05, 0x01};
+    const guint8 trail_n_tid0[] = {0x00, 0x00, 0x01, 0x00, 0x01, 0xaf};
+    const guint8 trail_n_tid2[] = {0x00, 0x00, 0x01, 0x00, 0x03, 0xaf};
+    const guint8 trail_r_tid2[] = {0x00, 0x00, 0x01, 0x02, 0x03, 0xaf};
+    guint8 hvcc[23];
+    GstBuffer *codec_data;
+    gint max_tid = -1;
+
+    // nothing is droppable before the sps tells the top sub-layer
+    fail_if(gst_es_h26x_is_droppable(trail_n_tid0, sizeof(trail_n_tid0), 0, TRUE, max_tid));
+    fail_unless(gst_es_h26x_get_max_tid(sps, sizeof(sps), 0, &max_tid));
+    fail_unless_equals_int(max_tid, 2);
+
+    // lower sub-layers may still be referenced by higher ones
+    fail_if(gst_es_h26x_is_droppable(trail_n_tid0, sizeof(trail_n_tid0), 0, TRUE, max_tid));
+    fail_unless(gst_es_h26x_is_droppable(trail_n_tid2, sizeof(trail_n_tid2), 0, TRUE, max_tid));
+    fail_if(gst_es_h26x_is_droppable(trail_r_tid2, sizeof(trail_r_tid2), 0, TRUE, max_tid));
+    fail_unless(gst_es_h26x_is_droppable(trail_n_tid0, sizeof(trail_n_tid0), 0, TRUE, 0));
+
+    // numTemporalLayers of the hvcC record
+    memset(hvcc, 0, sizeof(hvcc));
+    hvcc[0] = 1;
+    hvcc[21] = (3 << 3) | 0x3;
+    codec_data = gst_buffer_new_allocate(NULL, sizeof(hvcc), NULL);
+    gst_buffer_fill(codec_data, 0, hvcc, sizeof(hvcc));
+    max_tid = -1;
+    fail_unless(gst_es_h26x_get_hvcc_max_tid(codec_data, &max_tid));
+    fail_unless_equals_int(max_tid, 2);
+    fail_unless_equals_int(gst_es_h26x_get_nal_length_size("hvc1", codec_data), 4);
+    gst_buffer_unref(codec_data);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_h264_droppable) {
+    const guint8 non_ref[] = {0x00, 0x00, 0x00, 0x01, 0x01, 0x9a};
+    const guint8 ref[] = {0x00, 0x00, 0x00, 0x01, 0x21, 0x9a};
+    const guint8 no_slice[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0};
+
+    fail_unless(gst_es_h26x_is_droppable(non_ref, sizeof(non_ref), 0, FALSE, -1));
+    fail_if(gst_es_h26x_is_droppable(ref, sizeof(ref), 0, FALSE, -1));
+    fail_if(gst_es_h26x_is_droppable(no_slice, sizeof(no_slice), 0, FALSE, -1));
+}
+GST_END_TEST;
+
+/* the buffer holds exactly data, consumed */
+static void check_buffer(GstBuffer *buffer, const guint8 *data, gsize size) {
+    GstMapInfo mapinfo;
+
+    fail_unless(buffer != NULL);
+    fail_unless(gst_buffer_map(buffer, &mapinfo, GST_MAP_READ));
+    fail_unless_equals_int(mapinfo.size, size);
+    fail_unless(!memcmp(mapinfo.data, data, size));
+    gst_buffer_unmap(buffer, &mapinfo);
+    gst_buffer_unref(buffer);
+}
+
+GST_START_TEST(test_idr) {
+    const guint8 h264_idr[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1e, 0x95,
+                               0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x38, 0x80,
+                               0x00, 0x00, 0x01, 0x65, 0x88, 0x84};
+    const guint8 h264_non_idr[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0, 0x00, 0x00, 0x01, 0x41, 0x9a};
+    const guint8 h264_sei[] = {0x00, 0x00, 0x00, 0x01, 0x06, 0x05, 0x10};
+    const guint8 avc_idr[] = {0x00, 0x00, 0x00, 0x03, 0x65, 0x88, 0x84};
+    const guint8 h265_idr[] = {0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x10, 0x00, 0x00, 0x01, 0x28, 0x01, 0xaf};
+    const guint8 h265_cra[] = {0x00, 0x00, 0x00, 0x01, 0x2a, 0x01, 0xaf};
+    const guint8 h265_trail[] = {0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0xd0};
+
+    fail_unless(gst_es_h26x_is_idr(h264_idr, sizeof(h264_idr), 0, FALSE));
+    fail_if(gst_es_h26x_is_idr(h264_non_idr, sizeof(h264_non_idr), 0, FALSE));
+    fail_if(gst_es_h26x_is_idr(h264_sei, sizeof(h264_sei), 0, FALSE));
+    fail_unless(gst_es_h26x_is_idr(avc_idr, sizeof(avc_idr), 4, FALSE));
+    // idr_n_lp after an aud
+    fail_unless(gst_es_h26x_is_idr(h265_idr, sizeof(h265_idr), 0, TRUE));
+    // leading pictures of a cra may refer to the previous gop
+    fail_if(gst_es_h26x_is_idr(h265_cra, sizeof(h265_cra), 0, TRUE));
+    fail_if(gst_es_h26x_is_idr(h265_trail, sizeof(h265_trail), 0, TRUE));
+}
+GST_END_TEST;
+
+GST_START_TEST(test_h264_param_sets) {
+    const guint8 first[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1e, 0x95,
+                            0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x38, 0x80,
+                            0x00, 0x00, 0x01, 0x65, 0x88, 0x84};
+    const guint8 pps_only[] = {0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80,
+                               0x00, 0x00, 0x01, 0x65, 0x88, 0x84};
+    const guint8 idr_only[] = {0x00, 0x00, 0x01, 0x65, 0x88, 0x84};
+    const guint8 avc_idr[] = {0x00, 0x00, 0x00, 0x03, 0x65, 0x88, 0x84};
+    const guint8 sps[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1e, 0x95};
+    const guint8 sps_pps[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1e, 0x95,
+                              0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80};
+    const guint8 avc_sps_pps[] = {0x00, 0x00, 0x00, 0x05, 0x67, 0x42, 0x00, 0x1e, 0x95,
+                                  0x00, 0x00, 0x00, 0x04, 0x68, 0xce, 0x3c, 0x80};
+    GstEsH26xParamSets sets;
+
+    memset(&sets, 0, sizeof(GstEsH26xParamSets));
+    fail_if(gst_es_h26x_param_sets_missing(&sets, first, sizeof(first), 0, FALSE));
+    gst_es_h26x_param_sets_update(&sets, first, sizeof(first), 0, FALSE);
+    fail_if(gst_es_h26x_param_sets_missing(&sets, first, sizeof(first), 0, FALSE));
+
+    // a repeated pps alone still needs the sps in front of it
+    check_buffer(gst_es_h26x_param_sets_missing(&sets, pps_only, sizeof(pps_only), 0, FALSE), sps, sizeof(sps));
+    gst_es_h26x_param_sets_update(&sets, pps_only, sizeof(pps_only), 0, FALSE);
+
+    // the pps of the same id was replaced
+    check_buffer(gst_es_h26x_param_sets_missing(&sets, idr_only, sizeof(idr_only), 0, FALSE), sps_pps, sizeof(sps_pps));
+    check_buffer(
+        gst_es_h26x_param_sets_missing(&sets, avc_idr, sizeof(avc_idr), 4, FALSE), avc_sps_pps, sizeof(avc_sps_pps));
+    gst_es_h26x_param_sets_clear(&sets);
+    fail_if(gst_es_h26x_param_sets_missing(&sets, idr_only, sizeof(idr_only), 0, FALSE));
+}
+GST_END_TEST;
+
+GST_START_TEST(test_h265_param_sets) {
+    // the sps profile_tier_level carries emulation prevention bytes, its id is 1
+    const guint8 first[] = {0x00, 0x00, 0x00, 0x01, 0x40, 0x01, 0x0c, 0x01,
+                            0x00, 0x00, 0x00, 0x01, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00,
+                            0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x50,
+                            0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xc1,
+                            0x00, 0x00, 0x01, 0x26, 0x01, 0xaf};
+    const guint8 pps_only[] = {0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xc1, 0x00, 0x00, 0x01, 0x26, 0x01, 0xaf};
+    const guint8 sps0[] = {0x00, 0x00, 0x00, 0x01, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00,
+                           0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x80,
+                           0x00, 0x00, 0x01, 0x26, 0x01, 0xaf};
+    GstEsH26xParamSets sets;
+    GstBuffer *headers;
+    GstMapInfo mapinfo;
+
+    memset(&sets, 0, sizeof(GstEsH26xParamSets));
+    gst_es_h26x_param_sets_update(&sets, first, sizeof(first), 0, TRUE);
+
+    // vps and sps go first, in that order
+    check_buffer(gst_es_h26x_param_sets_missing(&sets, pps_only, sizeof(pps_only), 0, TRUE), first, 31);
+
+    // an sps of another id does not replace sps 1
+    headers = gst_es_h26x_param_sets_missing(&sets, sps0, sizeof(sps0), 0, TRUE);
+    fail_unless(headers != NULL);
+    fail_unless(gst_buffer_map(headers, &mapinfo, GST_MAP_READ));
+    fail_unless_equals_int(mapinfo.size, sizeof(first) - 6);
+    gst_buffer_unmap(headers, &mapinfo);
+    gst_buffer_unref(headers);
+    gst_es_h26x_param_sets_clear(&sets);
+}
+GST_END_TEST;
+
+static Suite *esh26xparse_suite(void) {
+    Suite *s = suite_create("esh26xparse");
+    TCase *tc_chain = tcase_create("general");
+
+    suite_add_tcase(s, tc_chain);
+    tcase_add_test(tc_chain, test_start_code_sizes);
+    tcase_add_test(tc_chain, test_start_code_edges);
+    tcase_add_test(tc_chain, test_trailing_zeros);
+    tcase_add_test(tc_chain, test_h264_au_boundaries);
+    tcase_add_test(tc_chain, test_h265_au_boundaries);
+    tcase_add_test(tc_chain, test_h265_droppable);
+    tcase_add_test(tc_chain, test_h264_droppable);
+    tcase_add_test(tc_chain, test_idr);
+    tcase_add_test(tc_chain, test_h264_param_sets);
+    tcase_add_test(tc_chain, test_h265_param_sets);
+    return s;
+}
+
+GST_CHECK_MAIN(esh26xparse);
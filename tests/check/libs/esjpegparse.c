@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) <2024> Beijing ESWIN Computing Technology Co., Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <gst/check/gstcheck.h>
+#include "gstesjpegparse.h"
+
+/* 640x480 4:2:0 picture whose exif segment carries a 16x16 thumbnail with its own SOI/SOF/EOI */
+static const guint8 exif_jpeg[] = {
+    0xff, 0xd8,
+    // APP1
+    0xff, 0xe1, 0x00, 0x2b, 'E', 'x', 'i', 'f', 0x00, 0x00,
+    0xff, 0xd8,
+    0xff, 0xc0, 0x00, 0x11, 0x08, 0x00, 0x10, 0x00, 0x10, 0x03, 0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+    0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00,
+    0x12, 0x34,
+    0xff, 0xd9,
+    // SOF0
+    0xff, 0xc0, 0x00, 0x11, 0x08, 0x01, 0xe0, 0x02, 0x80, 0x03, 0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+    // SOS, then entropy coded data with a stuffed zero, a restart marker and fill bytes
+    0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00,
+    0x12, 0xff, 0x00, 0x34, 0xff, 0xd0, 0x56, 0xff, 0xff,
+    0xff, 0xd9,
+};
+
+/* input as it arrives from upstream, in buffers of chunk bytes */
+static void push_data(GstAdapter *adapter, const guint8 *data, gsize size, gsize chunk) {
+    GstBuffer *buffer;
+    gsize offset, len;
+
+    for (offset = 0; offset < size; offset += len) {
+        len = MIN(chunk, size - offset);
+        buffer = gst_buffer_new_allocate(NULL, len, NULL);
+        gst_buffer_fill(buffer, 0, data + offset, len);
+        gst_adapter_push(adapter, buffer);
+    }
+}
+
+GST_START_TEST(test_find_soi) {
+    const guint8 garbage[] = {0x00, 0xff, 0xd8, 0x00, 0xff, 0xd8, 0xff, 0xe0};
+    const guint8 cut[] = {0x00, 0x00, 0xff, 0xd8};
+    GstAdapter *adapter = gst_adapter_new();
+
+    push_data(adapter, exif_jpeg, sizeof(exif_jpeg), 5);
+    fail_unless_equals_int(gst_es_jpeg_find_soi(adapter), 0);
+    gst_adapter_clear(adapter);
+    // an SOI is followed by a marker
+    push_data(adapter, garbage, sizeof(garbage), 3);
+    fail_unless_equals_int(gst_es_jpeg_find_soi(adapter), 4);
+    gst_adapter_clear(adapter);
+    push_data(adapter, cut, sizeof(cut), 1);
+    fail_unless_equals_int(gst_es_jpeg_find_soi(adapter), -1);
+    g_object_unref(adapter);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_scan_exif_thumbnail) {
+    GstAdapter *adapter = gst_adapter_new();
+    GstEsJpegScan scan;
+    gsize frame_size = 0;
+
+    memset(&scan, 0, sizeof(GstEsJpegScan));
+    push_data(adapter, exif_jpeg, sizeof(exif_jpeg), sizeof(exif_jpeg));
+    // the thumbnail EOI is inside the APP1 segment and does not end the frame
+    fail_unless(gst_es_jpeg_scan_frame(adapter, &scan, &frame_size));
+    fail_unless_equals_int(frame_size, sizeof(exif_jpeg));
+    fail_unless_equals_int(scan.offset, 0);
+    fail_if(scan.in_scan);
+    // the frame header ends at the SOS of the picture, not of the thumbnail
+    fail_unless_equals_int(scan.header_size, 2 + 0x2d + 19);
+    g_object_unref(adapter);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_scan_incremental) {
+    GstAdapter *adapter = gst_adapter_new();
+    GstEsJpegScan scan;
+    gsize size, frame_size = 0;
+
+    // frames arrive a byte at a time, the scan resumes where it stopped
+    memset(&scan, 0, sizeof(GstEsJpegScan));
+    push_data(adapter, exif_jpeg, 3, 1);
+    for (size = 4; size < sizeof(exif_jpeg); size++) {
+        push_data(adapter, exif_jpeg + size - 1, 1, 1);
+        fail_if(gst_es_jpeg_scan_frame(adapter, &scan, &frame_size));
+    }
+    push_data(adapter, exif_jpeg + size - 1, 1, 1);
+    fail_unless(gst_es_jpeg_scan_frame(adapter, &scan, &frame_size));
+    fail_unless_equals_int(frame_size, sizeof(exif_jpeg));
+
+    // back to back frames split at the first EOI
+    gst_adapter_clear(adapter);
+    push_data(adapter, exif_jpeg, sizeof(exif_jpeg), 7);
+    push_data(adapter, exif_jpeg, sizeof(exif_jpeg), 7);
+    memset(&scan, 0, sizeof(GstEsJpegScan));
+    fail_unless(gst_es_jpeg_scan_frame(adapter, &scan, &frame_size));
+    fail_unless_equals_int(frame_size, sizeof(exif_jpeg));
+    g_object_unref(adapter);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_frame_info) {
+    const gchar *sampling = NULL;
+    gint width = 0, height = 0;
+
+    // the size of the picture, not of the thumbnail
+    fail_unless(gst_es_jpeg_get_frame_info(exif_jpeg, sizeof(exif_jpeg), &width, &height, &sampling));
+    fail_unless_equals_int(width, 640);
+    fail_unless_equals_int(height, 480);
+    fail_unless_equals_string(sampling, "YCbCr-4:2:0");
+
+    // the frame header is cut off
+    fail_if(gst_es_jpeg_get_frame_info(exif_jpeg, 20, &width, &height, NULL));
+}
+GST_END_TEST;
+
+static Suite *esjpegparse_suite(void) {
+    Suite *s = suite_create("esjpegparse");
+    TCase *tc_chain = tcase_create("general");
+
+    suite_add_tcase(s, tc_chain);
+    tcase_add_test(tc_chain, test_find_soi);
+    tcase_add_test(tc_chain, test_scan_exif_thumbnail);
+    tcase_add_test(tc_chain, test_scan_incremental);
+    tcase_add_test(tc_chain, test_frame_info);
+    return s;
+}
+
+GST_CHECK_MAIN(esjpegparse);